@@ -23,6 +23,13 @@ def define(macro, value = nil)
   $defs.push("-D #{[macro.upcase, Shellwords.shellescape(value)].compact.join('=')}")
 end
 
+have_func('rb_enc_interned_str', 'ruby/encoding.h')
+have_func('rb_str_to_interned_str', 'ruby.h')
+have_func('rb_hash_new_capa', 'ruby.h')
+have_func('rb_ext_ractor_safe', 'ruby.h')
+have_func('rb_ractor_make_shareable', 'ruby/ractor.h')
+have_header('sys/mman.h') && have_func('mmap', 'sys/mman.h')
+
 $CFLAGS << ' -pedantic -Wall -Wextra -Werror '
 if ENV['DEBUG_BUILD']
   $CFLAGS.gsub!(/\W-Wp,-D_FORTIFY_SOURCE=\d+\W/, ' ')
@@ -35,7 +42,9 @@ if ENV['FETCH_JSONSL']
     File.write(File.join(__dir__, filename), remote.read)
   end
   Dir.chdir(__dir__) do
-    system('patch < jsonsl.h.patch')
+    Dir['jsonsl.*.patch'].sort.each do |patch|
+      system("patch < #{patch}")
+    end
   end
   sha1 = open('https://github.com/mnunberg/jsonsl').read[/commit-tease-sha.*?commit\/([a-f0-9]+)/m, 1]
   File.write(File.join(__dir__, 'jsonsl.rev'), sha1)
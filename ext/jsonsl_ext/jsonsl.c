@@ -7,76 +7,105 @@
 #include <limits.h>
 #include <ctype.h>
 
-#ifdef JSONSL_USE_METRICS
-#define XMETRICS \
-    X(STRINGY_INSIGNIFICANT) \
-    X(STRINGY_SLOWPATH) \
-    X(ALLOWED_WHITESPACE) \
-    X(QUOTE_FASTPATH) \
-    X(SPECIAL_FASTPATH) \
-    X(SPECIAL_WSPOP) \
-    X(SPECIAL_SLOWPATH) \
-    X(GENERIC) \
-    X(STRUCTURAL_TOKEN) \
-    X(SPECIAL_SWITCHFIRST) \
-    X(STRINGY_CATCH) \
-    X(NUMBER_FASTPATH) \
-    X(ESCAPES) \
-    X(TOTAL) \
-
-struct jsonsl_metrics_st {
-#define X(m) \
-    unsigned long metric_##m;
-    XMETRICS
-#undef X
-};
-
-static struct jsonsl_metrics_st GlobalMetrics = { 0 };
-static unsigned long GenericCounter[0x100] = { 0 };
-static unsigned long StringyCatchCounter[0x100] = { 0 };
+#ifndef JSONSL_NO_METRICS
+/*
+ * Functions which count anything start with DECLARE_METRICS, which caches
+ * jsn->metrics so that the disabled case costs one predictable branch.
+ */
+#define DECLARE_METRICS \
+    struct jsonsl_metrics_st *metrics = jsn->metrics;
 
 #define INCR_METRIC(m) \
-    GlobalMetrics.metric_##m++;
+    if (metrics) { metrics->metric_##m++; }
+
+#define ADD_METRIC(m, n) \
+    if (metrics) { metrics->metric_##m += (n); }
 
 #define INCR_GENERIC(c) \
-        INCR_METRIC(GENERIC); \
-        GenericCounter[c]++; \
+    if (metrics) { \
+        metrics->metric_GENERIC++; \
+        metrics->generic[c]++; \
+    }
 
 #define INCR_STRINGY_CATCH(c) \
-    INCR_METRIC(STRINGY_CATCH); \
-    StringyCatchCounter[c]++;
+    if (metrics) { \
+        metrics->metric_STRINGY_CATCH++; \
+        metrics->stringy_catch[c]++; \
+    }
 
 JSONSL_API
-void jsonsl_dump_global_metrics(void)
+int jsonsl_enable_metrics(jsonsl_t jsn, int enabled)
+{
+    if (!enabled) {
+        free(jsn->metrics);
+        jsn->metrics = NULL;
+        return 0;
+    }
+    if (jsn->metrics) {
+        memset(jsn->metrics, 0, sizeof(*jsn->metrics));
+        return 0;
+    }
+    jsn->metrics = calloc(1, sizeof(*jsn->metrics));
+    return jsn->metrics ? 0 : -1;
+}
+
+JSONSL_API
+void jsonsl_dump_metrics(jsonsl_t jsn)
 {
+    const struct jsonsl_metrics_st *metrics = jsn->metrics;
     int ii;
+
+    if (metrics == NULL) {
+        return;
+    }
     printf("JSONSL Metrics:\n");
 #define X(m) \
-    printf("\t%-30s %20lu (%0.2f%%)\n", #m, GlobalMetrics.metric_##m, \
-           (float)((float)(GlobalMetrics.metric_##m/(float)GlobalMetrics.metric_TOTAL)) * 100);
-    XMETRICS
+    printf("\t%-30s %20lu (%0.2f%%)\n", #m, metrics->metric_##m, \
+           metrics->metric_TOTAL ? (float)metrics->metric_##m / (float)metrics->metric_TOTAL * 100 : 0.0);
+    JSONSL_XMETRICS
 #undef X
     printf("Generic Characters:\n");
-    for (ii = 0; ii < 0xff; ii++) {
-        if (GenericCounter[ii]) {
-            printf("\t[ %c ] %lu\n", ii, GenericCounter[ii]);
+    for (ii = 0; ii < 0x100; ii++) {
+        if (metrics->generic[ii]) {
+            printf("\t[ %c ] %lu\n", ii, metrics->generic[ii]);
         }
     }
     printf("Weird string loop\n");
-    for (ii = 0; ii < 0xff; ii++) {
-        if (StringyCatchCounter[ii]) {
-            printf("\t[ %c ] %lu\n", ii, StringyCatchCounter[ii]);
+    for (ii = 0; ii < 0x100; ii++) {
+        if (metrics->stringy_catch[ii]) {
+            printf("\t[ %c ] %lu\n", ii, metrics->stringy_catch[ii]);
         }
     }
 }
 
 #else
+#define DECLARE_METRICS
 #define INCR_METRIC(m)
+#define ADD_METRIC(m, n)
 #define INCR_GENERIC(c)
 #define INCR_STRINGY_CATCH(c)
 JSONSL_API
-void jsonsl_dump_global_metrics(void) { }
-#endif /* JSONSL_USE_METRICS */
+int jsonsl_enable_metrics(jsonsl_t jsn, int enabled)
+{
+    (void)jsn;
+    return enabled ? -1 : 0;
+}
+
+JSONSL_API
+void jsonsl_dump_metrics(jsonsl_t jsn)
+{
+    (void)jsn;
+}
+#endif /* JSONSL_NO_METRICS */
+
+/*
+ * Metrics used to be process-wide and compiled in with JSONSL_USE_METRICS
+ * (a noop otherwise). They are per lexer now, see jsonsl_dump_metrics().
+ */
+JSONSL_API
+void jsonsl_dump_global_metrics(void)
+{
+}
 
 #define CASE_DIGITS \
 case '1': \
@@ -97,6 +126,241 @@ static int is_allowed_escape(unsigned);
 static int is_simple_char(unsigned);
 static char get_escape_equiv(unsigned);
 
+/*
+ * Vectorized scanners.
+ *
+ * Each scanner returns the length of the longest prefix of the buffer which
+ * does not need to be examined by the main loop. The scalar versions are
+ * always available, the SSE2/AVX2 versions are selected at runtime by
+ * jsonsl__scanners_init() (a constructor, run when the library is loaded).
+ */
+#if !defined(JSONSL_USE_WCHAR) && !defined(JSONSL_NO_SIMD) && \
+        defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JSONSL_HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+typedef size_t (*jsonsl__scan_fn)(const jsonsl_uchar_t *, size_t);
+/* String scanners also set *nonascii if any of the skipped bytes is >= 0x80 */
+typedef size_t (*jsonsl__str_scan_fn)(const jsonsl_uchar_t *, size_t, int *);
+
+static size_t
+jsonsl__str_scan_scalar(const jsonsl_uchar_t *bytes, size_t nbytes, int *nonascii)
+{
+    size_t ii;
+    unsigned acc = 0;
+    for (ii = 0; ii < nbytes && is_simple_char(bytes[ii]); ii++) {
+        acc |= bytes[ii];
+    }
+    if (acc & 0x80) {
+        *nonascii = 1;
+    }
+    return ii;
+}
+
+static size_t
+jsonsl__ws_scan_scalar(const jsonsl_uchar_t *bytes, size_t nbytes)
+{
+    size_t ii;
+    for (ii = 0; ii < nbytes && is_allowed_whitespace(bytes[ii]); ii++) {
+    }
+    return ii;
+}
+
+/* Stops at quotes and brackets, used while skipping ignored containers */
+static size_t
+jsonsl__skip_scan_scalar(const jsonsl_uchar_t *bytes, size_t nbytes)
+{
+    size_t ii;
+    for (ii = 0; ii < nbytes; ii++) {
+        unsigned c = bytes[ii] | 0x20;
+        if (bytes[ii] == '"' || c == '{' || c == '}') {
+            break;
+        }
+    }
+    return ii;
+}
+
+#ifdef JSONSL_HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t
+jsonsl__str_scan_sse2(const jsonsl_uchar_t *bytes, size_t nbytes, int *nonascii)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    __m128i high = _mm_setzero_si128();
+    size_t ii = 0;
+
+    for (; ii + 16 <= nbytes; ii += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bytes + ii));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash));
+        /* max(v, 0x1f) == 0x1f only for control characters */
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if (mask) {
+            unsigned stop = __builtin_ctz(mask);
+            if (_mm_movemask_epi8(high) | ((unsigned)_mm_movemask_epi8(v) & ((1U << stop) - 1))) {
+                *nonascii = 1;
+            }
+            return ii + stop;
+        }
+        high = _mm_or_si128(high, v);
+    }
+    if (_mm_movemask_epi8(high)) {
+        *nonascii = 1;
+    }
+    return ii + jsonsl__str_scan_scalar(bytes + ii, nbytes - ii, nonascii);
+}
+
+__attribute__((target("avx2")))
+static size_t
+jsonsl__str_scan_avx2(const jsonsl_uchar_t *bytes, size_t nbytes, int *nonascii)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i ctrl = _mm256_set1_epi8(0x1f);
+    __m256i high = _mm256_setzero_si256();
+    size_t ii = 0;
+
+    for (; ii + 32 <= nbytes; ii += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bytes + ii));
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask) {
+            unsigned stop = __builtin_ctz(mask);
+            if (_mm256_movemask_epi8(high) | ((unsigned)_mm256_movemask_epi8(v) & ((1U << stop) - 1))) {
+                *nonascii = 1;
+            }
+            return ii + stop;
+        }
+        high = _mm256_or_si256(high, v);
+    }
+    if (_mm256_movemask_epi8(high)) {
+        *nonascii = 1;
+    }
+    return ii + jsonsl__str_scan_sse2(bytes + ii, nbytes - ii, nonascii);
+}
+
+__attribute__((target("sse2")))
+static size_t
+jsonsl__ws_scan_sse2(const jsonsl_uchar_t *bytes, size_t nbytes)
+{
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    size_t ii = 0;
+
+    for (; ii + 16 <= nbytes; ii += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bytes + ii));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+        unsigned mask = ~(unsigned)_mm_movemask_epi8(m) & 0xffff;
+        if (mask) {
+            return ii + __builtin_ctz(mask);
+        }
+    }
+    return ii + jsonsl__ws_scan_scalar(bytes + ii, nbytes - ii);
+}
+
+__attribute__((target("avx2")))
+static size_t
+jsonsl__ws_scan_avx2(const jsonsl_uchar_t *bytes, size_t nbytes)
+{
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    size_t ii = 0;
+
+    for (; ii + 32 <= nbytes; ii += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bytes + ii));
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(m);
+        if (mask) {
+            return ii + __builtin_ctz(mask);
+        }
+    }
+    return ii + jsonsl__ws_scan_sse2(bytes + ii, nbytes - ii);
+}
+
+/* '[' and ']' differ from '{' and '}' only by the 0x20 bit */
+__attribute__((target("sse2")))
+static size_t
+jsonsl__skip_scan_sse2(const jsonsl_uchar_t *bytes, size_t nbytes)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    size_t ii = 0;
+
+    for (; ii + 16 <= nbytes; ii += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bytes + ii));
+        __m128i f = _mm_or_si128(v, lower);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(f, open), _mm_cmpeq_epi8(f, close));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quote));
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if (mask) {
+            return ii + __builtin_ctz(mask);
+        }
+    }
+    return ii + jsonsl__skip_scan_scalar(bytes + ii, nbytes - ii);
+}
+
+__attribute__((target("avx2")))
+static size_t
+jsonsl__skip_scan_avx2(const jsonsl_uchar_t *bytes, size_t nbytes)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i lower = _mm256_set1_epi8(0x20);
+    const __m256i open = _mm256_set1_epi8('{');
+    const __m256i close = _mm256_set1_epi8('}');
+    size_t ii = 0;
+
+    for (; ii + 32 <= nbytes; ii += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bytes + ii));
+        __m256i f = _mm256_or_si256(v, lower);
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(f, open), _mm256_cmpeq_epi8(f, close));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, quote));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask) {
+            return ii + __builtin_ctz(mask);
+        }
+    }
+    return ii + jsonsl__skip_scan_sse2(bytes + ii, nbytes - ii);
+}
+#endif /* JSONSL_HAVE_X86_SIMD */
+
+/*
+ * Selected scanners. Written once by jsonsl__scanners_init() when the
+ * library is loaded, so lexers on other threads only ever read them.
+ */
+static jsonsl__str_scan_fn jsonsl__str_scan = jsonsl__str_scan_scalar;
+static jsonsl__scan_fn jsonsl__ws_scan = jsonsl__ws_scan_scalar;
+static jsonsl__scan_fn jsonsl__skip_scan = jsonsl__skip_scan_scalar;
+
+#ifdef JSONSL_HAVE_X86_SIMD
+__attribute__((constructor))
+static void
+jsonsl__scanners_init(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        jsonsl__str_scan = jsonsl__str_scan_avx2;
+        jsonsl__ws_scan = jsonsl__ws_scan_avx2;
+        jsonsl__skip_scan = jsonsl__skip_scan_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        jsonsl__str_scan = jsonsl__str_scan_sse2;
+        jsonsl__ws_scan = jsonsl__ws_scan_sse2;
+        jsonsl__skip_scan = jsonsl__skip_scan_sse2;
+    }
+}
+#endif /* JSONSL_HAVE_X86_SIMD */
+
 JSONSL_API
 jsonsl_t jsonsl_new(int nlevels)
 {
@@ -107,20 +371,56 @@ jsonsl_t jsonsl_new(int nlevels)
         return NULL;
     }
 
-    jsn = (struct jsonsl_st *)
-            calloc(1, sizeof (*jsn) +
-                    ( (nlevels-1) * sizeof (struct jsonsl_state_st) )
-            );
-
+    jsn = (struct jsonsl_st *) calloc(1, sizeof (*jsn));
+    if (jsn == NULL) {
+        return NULL;
+    }
     jsn->levels_max = (unsigned int) nlevels;
+    jsn->levels_alloc = JSONSL_INITIAL_LEVELS < jsn->levels_max ?
+            JSONSL_INITIAL_LEVELS : jsn->levels_max;
+    jsn->stack = (struct jsonsl_state_st *)
+            calloc(jsn->levels_alloc, sizeof (struct jsonsl_state_st));
+    if (jsn->stack == NULL) {
+        free(jsn);
+        return NULL;
+    }
+
     jsn->max_callback_level = UINT_MAX;
     jsonsl_reset(jsn);
-    for (ii = 0; ii < jsn->levels_max; ii++) {
+    for (ii = 0; ii < jsn->levels_alloc; ii++) {
         jsn->stack[ii].level = ii;
     }
     return jsn;
 }
 
+/**
+ * Doubles the stack (capped at levels_max). New entries are zeroed, as
+ * jsonsl_new() would have done. Returns 0 on success
+ */
+static int
+jsonsl__stack_grow(jsonsl_t jsn)
+{
+    unsigned int ii, nalloc = jsn->levels_alloc * 2;
+    struct jsonsl_state_st *stack;
+
+    if (nalloc > jsn->levels_max) {
+        nalloc = jsn->levels_max;
+    }
+    stack = (struct jsonsl_state_st *)
+            realloc(jsn->stack, nalloc * sizeof (struct jsonsl_state_st));
+    if (stack == NULL) {
+        return -1;
+    }
+    memset(stack + jsn->levels_alloc, 0,
+           (nalloc - jsn->levels_alloc) * sizeof (struct jsonsl_state_st));
+    for (ii = jsn->levels_alloc; ii < nalloc; ii++) {
+        stack[ii].level = ii;
+    }
+    jsn->stack = stack;
+    jsn->levels_alloc = nalloc;
+    return 0;
+}
+
 JSONSL_API
 void jsonsl_reset(jsonsl_t jsn)
 {
@@ -130,13 +430,21 @@ void jsonsl_reset(jsonsl_t jsn)
     jsn->level = 0;
     jsn->stopfl = 0;
     jsn->in_escape = 0;
+    jsn->skip_state = 0;
+    jsn->skip_depth = 0;
     jsn->expecting = 0;
+    /* The root state is never pushed, clear what the previous input left */
+    jsn->stack[0].nelem = 0;
+    jsn->stack[0].pos_begin = 0;
+    jsn->stack[0].pos_cur = 0;
 }
 
 JSONSL_API
 void jsonsl_destroy(jsonsl_t jsn)
 {
     if (jsn) {
+        free(jsn->metrics);
+        free(jsn->stack);
         free(jsn);
     }
 }
@@ -152,23 +460,26 @@ void jsonsl_destroy(jsonsl_t jsn)
  * @param jsn the parser
  * @param[in,out] bytes_p A pointer to the current buffer (i.e. current position)
  * @param[in,out] nbytes_p A pointer to the current size of the buffer
+ * @param state the string state, flagged with SPECIALf_NONASCII when a
+ * byte >= 0x80 is skipped
  * @return true if all bytes have been exhausted (and thus the main loop can
  * return), false if a special character was examined which requires greater
  * examination.
  */
 static int
 jsonsl__str_fastparse(jsonsl_t jsn,
-                      const jsonsl_uchar_t **bytes_p, size_t *nbytes_p)
+                      const jsonsl_uchar_t **bytes_p, size_t *nbytes_p,
+                      struct jsonsl_state_st *state)
 {
+    DECLARE_METRICS
+#ifdef JSONSL_USE_WCHAR
     const jsonsl_uchar_t *bytes = *bytes_p;
     const jsonsl_uchar_t *end;
     for (end = bytes + *nbytes_p; bytes != end; bytes++) {
-        if (
-#ifdef JSONSL_USE_WCHAR
-                *bytes >= 0x100 ||
-#endif /* JSONSL_USE_WCHAR */
-                (is_simple_char(*bytes))) {
-            INCR_METRIC(TOTAL);
+        if (*bytes >= 0x100 || (is_simple_char(*bytes))) {
+            if (*bytes >= 0x80) {
+                state->special_flags |= JSONSL_SPECIALf_NONASCII;
+            }
             INCR_METRIC(STRINGY_INSIGNIFICANT);
         } else {
             /* Once we're done here, re-calculate the position variables */
@@ -182,32 +493,112 @@ jsonsl__str_fastparse(jsonsl_t jsn,
     /* Once we're done here, re-calculate the position variables */
     jsn->pos += (bytes - *bytes_p);
     return FASTPARSE_EXHAUSTED;
+#else
+    int nonascii = 0;
+    size_t nskip = jsonsl__str_scan(*bytes_p, *nbytes_p, &nonascii);
+
+    if (nonascii) {
+        state->special_flags |= JSONSL_SPECIALf_NONASCII;
+    }
+    ADD_METRIC(STRINGY_INSIGNIFICANT, nskip);
+    /* Once we're done here, re-calculate the position variables */
+    jsn->pos += nskip;
+    if (nskip == *nbytes_p) {
+        return FASTPARSE_EXHAUSTED;
+    }
+    *nbytes_p -= nskip;
+    *bytes_p += nskip;
+    return FASTPARSE_BREAK;
+#endif /* JSONSL_USE_WCHAR */
 }
 
+#define JSONSL__IS_DIGIT(c) ((unsigned)((c) - '0') < 10)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define JSONSL_HAVE_SWAR
+/*
+ * SWAR (SIMD within a register) helpers for numbers. The eight input bytes
+ * are loaded into an integer, the first byte being the least significant one.
+ */
+
+/* Returns how many of the leading bytes are ASCII digits (0..8) */
+static unsigned
+jsonsl__swar_ndigits(uint64_t chunk)
+{
+    const uint64_t zeros = 0x3030303030303030ULL;
+    const uint64_t high = 0xF0F0F0F0F0F0F0F0ULL;
+    /* a byte is a digit if its high nibble is 3, and still is after adding 6 */
+    uint64_t nondigit = ((chunk & high) ^ zeros) | (((chunk + 0x0606060606060606ULL) & high) ^ zeros);
+    if (nondigit == 0) {
+        return 8;
+    }
+    return (unsigned)__builtin_ctzll(nondigit) >> 3;
+}
+
+/* Converts eight ASCII digits into their integer value */
+static uint64_t
+jsonsl__swar_parse8(uint64_t chunk)
+{
+    const uint64_t mask = 0x000000FF000000FFULL;
+    const uint64_t mul1 = 0x000F424000000064ULL; /* 100 + (1000000 << 32) */
+    const uint64_t mul2 = 0x0000271000000001ULL; /* 1 + (10000 << 32) */
+    chunk -= 0x3030303030303030ULL;
+    chunk = (chunk * 10) + (chunk >> 8);
+    return (((chunk & mask) * mul1) + (((chunk >> 16) & mask) * mul2)) >> 32;
+}
+
+static const uint64_t jsonsl__pow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL
+};
+#endif /* JSONSL_HAVE_SWAR */
+
 /* Functions exactly like str_fastparse, except it also accepts a 'state'
- * argument, since the number's value is updated in the state. */
+ * argument, since the number's value is updated in the state. Digits are
+ * consumed eight at a time when the platform allows it. Digits following
+ * the decimal point keep accumulating into the mantissa and are counted in
+ * JSONSL_NUMERIC_FRACTION. */
 static int
 jsonsl__num_fastparse(jsonsl_t jsn,
                       const jsonsl_uchar_t **bytes_p, size_t *nbytes_p,
                       struct jsonsl_state_st *state)
 {
-    int exhausted = 1;
+    DECLARE_METRICS
     size_t nbytes = *nbytes_p;
     const jsonsl_uchar_t *bytes = *bytes_p;
-
-    for (; nbytes; nbytes--, bytes++) {
-        jsonsl_uchar_t c = *bytes;
-        if (isdigit(c)) {
-            INCR_METRIC(TOTAL);
-            INCR_METRIC(NUMBER_FASTPATH);
-            state->nelem = (state->nelem * 10) + (c - 0x30);
-        } else {
-            exhausted = 0;
+    uint64_t nelem = state->nelem;
+
+#ifdef JSONSL_HAVE_SWAR
+    while (nbytes >= 8) {
+        uint64_t chunk;
+        unsigned ndigits;
+
+        memcpy(&chunk, bytes, sizeof(chunk));
+        ndigits = jsonsl__swar_ndigits(chunk);
+        if (ndigits == 8) {
+            nelem = nelem * 100000000ULL + jsonsl__swar_parse8(chunk);
+        } else if (ndigits) {
+            /* move the digits to the top, and pad them with leading zeros */
+            chunk = (chunk << (8 * (8 - ndigits))) | (0x3030303030303030ULL >> (8 * ndigits));
+            nelem = nelem * jsonsl__pow10[ndigits] + jsonsl__swar_parse8(chunk);
+        }
+        bytes += ndigits;
+        nbytes -= ndigits;
+        if (ndigits != 8) {
             break;
         }
     }
+#endif /* JSONSL_HAVE_SWAR */
+    for (; nbytes && JSONSL__IS_DIGIT(*bytes); nbytes--, bytes++) {
+        nelem = (nelem * 10) + (*bytes - 0x30);
+    }
+    state->nelem = nelem;
+    if ((state->special_flags & JSONSL_SPECIALf_FLOAT) && *nbytes_p != nbytes) {
+        state->nescapes += (unsigned int)(*nbytes_p - nbytes);
+        jsn->tok_last = '1';
+    }
+    ADD_METRIC(NUMBER_FASTPATH, *nbytes_p - nbytes);
     jsn->pos += (*nbytes_p - nbytes);
-    if (exhausted) {
+    if (nbytes == 0) {
         return FASTPARSE_EXHAUSTED;
     }
     *nbytes_p = nbytes;
@@ -215,6 +606,77 @@ jsonsl__num_fastparse(jsonsl_t jsn,
     return FASTPARSE_BREAK;
 }
 
+#ifndef JSONSL_USE_WCHAR
+#define JSONSL__SKIP_NONE 0
+#define JSONSL__SKIP_STRUCTURE 1
+#define JSONSL__SKIP_STRING 2
+#define JSONSL__SKIP_ESCAPE 3
+
+/*
+ * Skips the contents of a container whose children are all ignored, only
+ * following strings and bracket nesting. The state is kept in the lexer so
+ * that skipping can resume in the next chunk.
+ *
+ * @return FASTPARSE_EXHAUSTED if the input ran out, FASTPARSE_BREAK if
+ * *bytes_p points at the token closing the skipped container
+ */
+static int
+jsonsl__skip_fastparse(jsonsl_t jsn,
+                       const jsonsl_uchar_t **bytes_p, size_t *nbytes_p)
+{
+    DECLARE_METRICS
+    const jsonsl_uchar_t *bytes = *bytes_p;
+    const jsonsl_uchar_t *end = bytes + *nbytes_p;
+    unsigned int depth = jsn->skip_depth;
+    int skip_state = jsn->skip_state;
+    int nonascii = 0; /* not needed while skipping */
+
+    while (bytes != end) {
+        if (skip_state == JSONSL__SKIP_ESCAPE) {
+            skip_state = JSONSL__SKIP_STRING;
+            bytes++;
+            continue;
+        }
+        if (skip_state == JSONSL__SKIP_STRING) {
+            bytes += jsonsl__str_scan(bytes, end - bytes, &nonascii);
+            if (bytes == end) {
+                break;
+            }
+            if (*bytes == '\\') {
+                skip_state = JSONSL__SKIP_ESCAPE;
+            } else if (*bytes == '"') {
+                skip_state = JSONSL__SKIP_STRUCTURE;
+            }
+            bytes++;
+            continue;
+        }
+        bytes += jsonsl__skip_scan(bytes, end - bytes);
+        if (bytes == end) {
+            break;
+        }
+        if (*bytes == '"') {
+            skip_state = JSONSL__SKIP_STRING;
+        } else if (*bytes == '[' || *bytes == '{') {
+            depth++;
+        } else if (depth) {
+            depth--;
+        } else {
+            skip_state = JSONSL__SKIP_NONE;
+            break;
+        }
+        bytes++;
+    }
+
+    jsn->skip_depth = depth;
+    jsn->skip_state = (char)skip_state;
+    ADD_METRIC(SKIPPED, bytes - *bytes_p);
+    jsn->pos += bytes - *bytes_p;
+    *nbytes_p -= bytes - *bytes_p;
+    *bytes_p = bytes;
+    return skip_state == JSONSL__SKIP_NONE ? FASTPARSE_BREAK : FASTPARSE_EXHAUSTED;
+}
+#endif /* JSONSL_USE_WCHAR */
+
 JSONSL_API
 void
 jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
@@ -231,6 +693,10 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
         jsn->error_callback(jsn, JSONSL_ERROR_LEVELS_EXCEEDED, state, (char*)c); \
         return; \
     } \
+    if (jsn->level + 1 >= jsn->levels_alloc && jsonsl__stack_grow(jsn) != 0) { \
+        jsn->error_callback(jsn, JSONSL_ERROR_ENOMEM, state, (char*)c); \
+        return; \
+    } \
     state = jsn->stack + (++jsn->level); \
     state->ignore_callback = jsn->stack[jsn->level-1].ignore_callback; \
     state->pos_begin = jsn->pos;
@@ -299,6 +765,10 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
     ((state)->special_flags == JSONSL_SPECIALf_UNSIGNED || \
         (state)->special_flags == JSONSL_SPECIALf_SIGNED)
 
+#define IS_FRACTION_NUMBER \
+    ((state)->special_flags == (JSONSL_SPECIALf_UNSIGNED|JSONSL_SPECIALf_FLOAT) || \
+        (state)->special_flags == (JSONSL_SPECIALf_SIGNED|JSONSL_SPECIALf_FLOAT))
+
 #define STATE_NUM_LAST jsn->tok_last
 
 #define CONTINUE_NEXT_CHAR() continue
@@ -306,11 +776,20 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
     const jsonsl_uchar_t *c = (jsonsl_uchar_t*)bytes;
     size_t levels_max = jsn->levels_max;
     struct jsonsl_state_st *state = jsn->stack + jsn->level;
+    DECLARE_METRICS
     jsn->base = bytes;
+    ADD_METRIC(TOTAL, nbytes);
+
+#ifndef JSONSL_USE_WCHAR
+    /* Still inside an ignored container from the previous chunk */
+    if (jsn->skip_state != JSONSL__SKIP_NONE &&
+            jsonsl__skip_fastparse(jsn, &c, &nbytes) == FASTPARSE_EXHAUSTED) {
+        return;
+    }
+#endif
 
     for (; nbytes; nbytes--, jsn->pos++, c++) {
         unsigned state_type;
-        INCR_METRIC(TOTAL);
 
         GT_AGAIN:
         state_type = state->type;
@@ -330,7 +809,7 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
                 CONTINUE_NEXT_CHAR();
             }
 
-            if (jsonsl__str_fastparse(jsn, &c, &nbytes) ==
+            if (jsonsl__str_fastparse(jsn, &c, &nbytes, state) ==
                     FASTPARSE_EXHAUSTED) {
                 /* No need to readjust variables as we've exhausted the iterator */
                 return;
@@ -346,8 +825,8 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
             INCR_METRIC(STRINGY_SLOWPATH);
 
         } else if (state_type == JSONSL_T_SPECIAL) {
-            /* Fast track for signed/unsigned */
-            if (IS_NORMAL_NUMBER) {
+            /* Fast track for signed/unsigned and their fractional digits */
+            if (IS_NORMAL_NUMBER || IS_FRACTION_NUMBER) {
                 if (jsonsl__num_fastparse(jsn, &c, &nbytes, state) ==
                         FASTPARSE_EXHAUSTED) {
                     return;
@@ -363,13 +842,13 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
                 }
 #endif
 
-                if (!isdigit(CUR_CHAR)) {
+                if (!JSONSL__IS_DIGIT(CUR_CHAR)) {
                     INVOKE_ERROR(INVALID_NUMBER);
                 }
 
                 if (CUR_CHAR == '0') {
                     state->special_flags = JSONSL_SPECIALf_ZERO|JSONSL_SPECIALf_SIGNED;
-                } else if (isdigit(CUR_CHAR)) {
+                } else if (JSONSL__IS_DIGIT(CUR_CHAR)) {
                     state->special_flags = JSONSL_SPECIALf_SIGNED;
                     state->nelem = CUR_CHAR - 0x30;
                 } else {
@@ -377,8 +856,9 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
                 }
                 CONTINUE_NEXT_CHAR();
 
-            } else if (state->special_flags == JSONSL_SPECIALf_ZERO) {
-                if (isdigit(CUR_CHAR)) {
+            } else if (state->special_flags == JSONSL_SPECIALf_ZERO ||
+                    state->special_flags == (JSONSL_SPECIALf_ZERO|JSONSL_SPECIALf_SIGNED)) {
+                if (JSONSL__IS_DIGIT(CUR_CHAR)) {
                     /* Following a zero! */
                     INVOKE_ERROR(INVALID_NUMBER);
                 }
@@ -404,6 +884,7 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
                         INVOKE_ERROR(INVALID_NUMBER);
                     }
                     state->special_flags |= JSONSL_SPECIALf_FLOAT;
+                    JSONSL_NUMERIC_FRACTION(state) = 0;
                     STATE_NUM_LAST = '.';
                     CONTINUE_NEXT_CHAR();
 
@@ -517,8 +998,16 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
         } else if (is_allowed_whitespace(CUR_CHAR)) {
             INCR_METRIC(ALLOWED_WHITESPACE);
             /* So we're not special. Harmless insignificant whitespace
-             * passthrough
+             * passthrough. Indentation comes in runs, so skip the whole
+             * run at once, leaving the last byte to the loop increment.
              */
+            if (nbytes > 1 && is_allowed_whitespace(c[1])) {
+                size_t nskip = jsonsl__ws_scan(c + 1, nbytes - 1);
+                ADD_METRIC(ALLOWED_WHITESPACE, nskip);
+                c += nskip;
+                nbytes -= nskip;
+                jsn->pos += nskip;
+            }
             CONTINUE_NEXT_CHAR();
         } else if (extract_special(CUR_CHAR)) {
             /* not a string, whitespace, or structural token. must be special */
@@ -552,6 +1041,7 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
 
                     STACK_PUSH;
                     state->type = JSONSL_T_STRING;
+                    state->special_flags = 0;
                     DO_CALLBACK(STRING, PUSH);
 
                 } else {
@@ -564,6 +1054,7 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
 
                     STACK_PUSH;
                     state->type = JSONSL_T_HKEY;
+                    state->special_flags = 0;
                     DO_CALLBACK(HKEY, PUSH);
                 }
                 CONTINUE_NEXT_CHAR();
@@ -572,6 +1063,7 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
                 state->nelem++;
                 STACK_PUSH;
                 state->type = JSONSL_T_STRING;
+                state->special_flags = 0;
                 jsn->expecting = ',';
                 jsn->tok_last = 0;
                 DO_CALLBACK(STRING, PUSH);
@@ -662,6 +1154,20 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
                 DO_CALLBACK(LIST, PUSH);
             }
             jsn->tok_last = 0;
+#ifndef JSONSL_USE_WCHAR
+            if (jsn->options.skip_ignored &&
+                    (state->ignore_callback || jsn->max_callback_level <= state->level + 1)) {
+                jsn->skip_state = JSONSL__SKIP_STRUCTURE;
+                jsn->skip_depth = 0;
+                c++;
+                nbytes--;
+                jsn->pos++;
+                if (jsonsl__skip_fastparse(jsn, &c, &nbytes) == FASTPARSE_EXHAUSTED) {
+                    return;
+                }
+                goto GT_STRUCTURAL_TOKEN;
+            }
+#endif
             CONTINUE_NEXT_CHAR();
 
             /* closing of list or object */
@@ -1409,7 +1915,9 @@ size_t jsonsl_util_unescape_ex(const char *in,
             last_codepoint = 0;
 
         } else if (uescval < 0xD800 || uescval > 0xDFFF) {
-            *oflags |= JSONSL_SPECIALf_NONASCII;
+            if (uescval >= 0x80) {
+                *oflags |= JSONSL_SPECIALf_NONASCII;
+            }
             out = jsonsl__writeutf8(uescval, out) - 1;
 
         } else if (uescval < 0xDC00) {
@@ -1448,7 +1956,7 @@ size_t jsonsl_util_unescape_ex(const char *in,
  * This table contains the beginnings of non-string
  * allowable (bareword) values.
  */
-static unsigned short Special_Table[0x100] = {
+static const unsigned short Special_Table[0x100] = {
         /* 0x00 */ 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 0x1f */
         /* 0x20 */ 0,0,0,0,0,0,0,0,0,0,0,0,0, /* 0x2c */
         /* 0x2d */ JSONSL_SPECIALf_DASH /* <-> */, /* 0x2d */
@@ -1486,7 +1994,7 @@ static unsigned short Special_Table[0x100] = {
  * Contains characters which signal the termination of any of the 'special' bareword
  * values.
  */
-static int Special_Endings[0x100] = {
+static const int Special_Endings[0x100] = {
         /* 0x00 */ 0,0,0,0,0,0,0,0,0, /* 0x08 */
         /* 0x09 */ 1 /* <TAB> */, /* 0x09 */
         /* 0x0a */ 1 /* <LF> */, /* 0x0a */
@@ -1518,7 +2026,7 @@ static int Special_Endings[0x100] = {
 /**
  * This table contains entries for the allowed whitespace as per RFC 4627
  */
-static int Allowed_Whitespace[0x100] = {
+static const int Allowed_Whitespace[0x100] = {
         /* 0x00 */ 0,0,0,0,0,0,0,0,0, /* 0x08 */
         /* 0x09 */ 1 /* <TAB> */, /* 0x09 */
         /* 0x0a */ 1 /* <LF> */, /* 0x0a */
@@ -1556,7 +2064,19 @@ static const int String_No_Passthrough[0x100] = {
         /* 0x11 */ 1 /* <DC1> */, /* 0x11 */
         /* 0x12 */ 1 /* <DC2> */, /* 0x12 */
         /* 0x13 */ 1 /* <DC3> */, /* 0x13 */
-        /* 0x14 */ 0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 0x21 */
+        /* 0x14 */ 1 /* <DC4> */, /* 0x14 */
+        /* 0x15 */ 1 /* <NAK> */, /* 0x15 */
+        /* 0x16 */ 1 /* <SYN> */, /* 0x16 */
+        /* 0x17 */ 1 /* <ETB> */, /* 0x17 */
+        /* 0x18 */ 1 /* <CAN> */, /* 0x18 */
+        /* 0x19 */ 1 /* <EM> */, /* 0x19 */
+        /* 0x1a */ 1 /* <SUB> */, /* 0x1a */
+        /* 0x1b */ 1 /* <ESC> */, /* 0x1b */
+        /* 0x1c */ 1 /* <FS> */, /* 0x1c */
+        /* 0x1d */ 1 /* <GS> */, /* 0x1d */
+        /* 0x1e */ 1 /* <RS> */, /* 0x1e */
+        /* 0x1f */ 1 /* <US> */, /* 0x1f */
+        /* 0x20 */ 0,0, /* 0x21 */
         /* 0x22 */ 1 /* <"> */, /* 0x22 */
         /* 0x23 */ 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 0x42 */
         /* 0x43 */ 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 0x5b */
@@ -1572,7 +2092,7 @@ static const int String_No_Passthrough[0x100] = {
 /**
  * Allowable two-character 'common' escapes:
  */
-static int Allowed_Escapes[0x100] = {
+static const int Allowed_Escapes[0x100] = {
         /* 0x00 */ 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 0x1f */
         /* 0x20 */ 0,0, /* 0x21 */
         /* 0x22 */ 1 /* <"> */, /* 0x22 */
@@ -1602,7 +2122,7 @@ static int Allowed_Escapes[0x100] = {
 /**
  * This table contains the _values_ for a given (single) escaped character.
  */
-static unsigned char Escape_Equivs[0x100] = {
+static const unsigned char Escape_Equivs[0x100] = {
         /* 0x00 */ 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 0x1f */
         /* 0x20 */ 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 0x3f */
         /* 0x40 */ 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, /* 0x5f */
@@ -1644,7 +2164,9 @@ static int is_simple_char(unsigned c) {
 }
 
 /* Clean up all our macros! */
+#undef DECLARE_METRICS
 #undef INCR_METRIC
+#undef ADD_METRIC
 #undef INCR_GENERIC
 #undef INCR_STRINGY_CATCH
 #undef CASE_DIGITS
@@ -1664,3 +2186,4 @@ static int is_simple_char(unsigned c) {
 #undef STATE_NUM_LAST
 #undef FASTPARSE_EXHAUSTED
 #undef FASTPARSE_BREAK
+#undef JSONSL__IS_DIGIT
@@ -14,8 +14,7 @@
 
 #include <ruby.h>
 #define JSONSL_STATE_USER_FIELDS \
-	VALUE val; \
-	VALUE pkey;
+	VALUE val;
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -101,6 +100,14 @@ typedef int ssize_t;
 
 #define JSONSL_MAX_LEVELS 512
 
+/**
+ * Number of stack entries allocated by jsonsl_new(). The stack is grown
+ * on demand (doubling) up to the nlevels limit.
+ */
+#ifndef JSONSL_INITIAL_LEVELS
+#define JSONSL_INITIAL_LEVELS 16
+#endif
+
 struct jsonsl_st;
 typedef struct jsonsl_st *jsonsl_t;
 
@@ -291,7 +298,11 @@ struct jsonsl_state_st {
      */
     unsigned type;
 
-    /** If this element is special, then its extended type is here */
+    /**
+     * If this element is special, then its extended type is here. For
+     * strings and hash keys, JSONSL_SPECIALf_NONASCII is set if the raw
+     * contents have a byte >= 0x80
+     */
     unsigned special_flags;
 
     /**
@@ -327,8 +338,9 @@ struct jsonsl_state_st {
      *
      * For special types, this will hold the sum of the digits.
      * This only holds true for values which are simple signed/unsigned
-     * numbers. Otherwise a special flag is set, and extra handling is not
-     * performed.
+     * numbers, or the mantissa digits (without the decimal point) of floats
+     * having JSONSL_SPECIALf_FLOAT set. The exponent is not accumulated.
+     * The value wraps around for more than 19 digits.
      */
     uint64_t nelem;
 
@@ -393,6 +405,13 @@ struct jsonsl_state_st {
  */
 #define JSONSL_NUMERIC_VALUE(st) ((st)->nelem)
 
+/**Gets the number of digits after the decimal point.
+ * @param st The state. Must be of type JSONSL_T_SPECIAL and
+ *           special_flags must have the JSONSL_SPECIALf_FLOAT flag set.
+ * @return the number of fractional digits in JSONSL_NUMERIC_VALUE
+ */
+#define JSONSL_NUMERIC_FRACTION(st) ((st)->nescapes)
+
 /*
  * So now we need some special structure for keeping the
  * JPR info in sync. Preferrably all in a single block
@@ -463,6 +482,41 @@ typedef int (*jsonsl_error_callback)(
         struct jsonsl_state_st* state,
         jsonsl_char_t *at);
 
+/**
+ * Counters describing which paths of the lexer the input went through.
+ * Every counter is in bytes, except for the structural and escape counts;
+ * TOTAL is the number of bytes passed to jsonsl_feed().
+ * Collection is off by default and can be switched on per lexer with
+ * jsonsl_enable_metrics(); building with JSONSL_NO_METRICS removes the
+ * bookkeeping entirely.
+ */
+#define JSONSL_XMETRICS \
+    X(STRINGY_INSIGNIFICANT) \
+    X(STRINGY_SLOWPATH) \
+    X(ALLOWED_WHITESPACE) \
+    X(QUOTE_FASTPATH) \
+    X(SPECIAL_FASTPATH) \
+    X(SPECIAL_WSPOP) \
+    X(SPECIAL_SLOWPATH) \
+    X(GENERIC) \
+    X(STRUCTURAL_TOKEN) \
+    X(SPECIAL_SWITCHFIRST) \
+    X(STRINGY_CATCH) \
+    X(NUMBER_FASTPATH) \
+    X(ESCAPES) \
+    X(SKIPPED) \
+    X(TOTAL) \
+
+struct jsonsl_metrics_st {
+#define X(m) \
+    unsigned long metric_##m;
+    JSONSL_XMETRICS
+#undef X
+    /** Per-character counts for GENERIC and STRINGY_CATCH */
+    unsigned long generic[0x100];
+    unsigned long stringy_catch[0x100];
+};
+
 struct jsonsl_st {
     /** Public, read-only */
 
@@ -544,18 +598,34 @@ struct jsonsl_st {
 
     struct {
         int allow_trailing_comma;
+        /**
+         * Skip over the contents of containers whose children would not
+         * receive callbacks (see max_callback_level and ignore_callback),
+         * tracking only strings and bracket nesting. Skipped contents are
+         * not validated and do not contribute to the container's nelem.
+         */
+        int skip_ignored;
     } options;
 
     /** Put anything here */
     void *data;
 
+    /**
+     * Metrics for this lexer, or NULL if they are not being collected.
+     * See jsonsl_enable_metrics()
+     */
+    struct jsonsl_metrics_st *metrics;
+
     /*@{*/
     /** Private */
     int in_escape;
+    unsigned int skip_depth;
+    char skip_state;
     char expecting;
     char tok_last;
     int can_insert;
     unsigned int levels_max;
+    unsigned int levels_alloc;
 
 #ifndef JSONSL_NO_JPR
     size_t jpr_count;
@@ -567,17 +637,21 @@ struct jsonsl_st {
     /*@}*/
 
     /**
-     * This is the stack. Its upper bound is levels_max, or the
-     * nlevels argument passed to jsonsl_new. If you modify this structure,
-     * make sure that this member is last.
+     * This is the stack. It holds levels_alloc entries and is grown while
+     * pushing, up to levels_max (the nlevels argument passed to jsonsl_new).
+     * Growing moves the entries, so state pointers must not be kept across
+     * a push.
      */
-    struct jsonsl_state_st stack[1];
+    struct jsonsl_state_st *stack;
 };
 
 
 /**
  * Creates a new lexer object, with capacity for recursion up to nlevels
  *
+ * Only JSONSL_INITIAL_LEVELS stack entries are allocated up front, the
+ * rest are allocated as the input nests deeper.
+ *
  * @param nlevels maximum recursion depth
  */
 JSONSL_API
@@ -684,8 +758,26 @@ JSONSL_API
 const char* jsonsl_strtype(jsonsl_type_t jt);
 
 /**
- * Dumps global metrics to the screen. This is a noop unless
- * jsonsl was compiled with JSONSL_USE_METRICS
+ * Turns metrics collection on or off for a lexer. Enabling allocates
+ * zeroed counters in jsn->metrics (existing counters are cleared),
+ * disabling releases them. Counters survive jsonsl_reset().
+ *
+ * @return 0 on success, -1 if the counters could not be allocated or
+ * jsonsl was compiled with JSONSL_NO_METRICS
+ */
+JSONSL_API
+int jsonsl_enable_metrics(jsonsl_t jsn, int enabled);
+
+/**
+ * Dumps the metrics of the lexer to the screen. This is a noop unless
+ * metrics were enabled with jsonsl_enable_metrics()
+ */
+JSONSL_API
+void jsonsl_dump_metrics(jsonsl_t jsn);
+
+/**
+ * Kept for compatibility, it is a noop: metrics are no longer global.
+ * @deprecated use jsonsl_dump_metrics()
  */
 JSONSL_API
 void jsonsl_dump_global_metrics(void);
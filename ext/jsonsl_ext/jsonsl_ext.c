@@ -22,6 +22,103 @@
 VALUE jsl_mJSONSL;
 VALUE jsl_eError;
 
+static VALUE jsl_sym_mode;
+VALUE jsl_sym_lexer;
+static VALUE jsl_sym_index;
+static VALUE jsl_sym_stats;
+VALUE jsl_sym_symbolize_names;
+VALUE jsl_sym_freeze;
+static VALUE jsl_sym_chunk_size;
+static VALUE jsl_sym_release_gvl;
+static ID jsl_id_read;
+
+void jsl_shapes_reset(jsl_SHAPES *shapes)
+{
+    memset(shapes->nkeys, 0, sizeof(shapes->nkeys));
+}
+
+void jsl_shapes_mark(const jsl_SHAPES *shapes)
+{
+    unsigned depth, nkey;
+
+    for (depth = 0; depth < JSL_SHAPE_DEPTH; depth++) {
+        for (nkey = 0; nkey < shapes->nkeys[depth]; nkey++) {
+            rb_gc_mark(shapes->slots[depth][nkey].key);
+        }
+    }
+}
+
+/* Returns Qundef unless the key has the same bytes as the predicted one */
+VALUE jsl_shapes_lookup(const jsl_SHAPES *shapes, unsigned depth, size_t nkey, const char *ptr, size_t len)
+{
+    const jsl_KEY_SLOT *slot;
+
+    if (depth >= JSL_SHAPE_DEPTH || nkey >= shapes->nkeys[depth]) {
+        return Qundef;
+    }
+    slot = &shapes->slots[depth][nkey];
+    if (slot->len != len || memcmp(slot->ptr, ptr, len) != 0) {
+        return Qundef;
+    }
+    return slot->key;
+}
+
+void jsl_shapes_store(jsl_SHAPES *shapes, unsigned depth, size_t nkey, const char *ptr, size_t len, VALUE key)
+{
+    jsl_KEY_SLOT *slot;
+
+    if (depth >= JSL_SHAPE_DEPTH || nkey >= JSL_SHAPE_KEYS || nkey > shapes->nkeys[depth]) {
+        return;
+    }
+    slot = &shapes->slots[depth][nkey];
+    slot->ptr = ptr;
+    slot->len = len;
+    slot->key = key;
+    if (nkey == shapes->nkeys[depth]) {
+        shapes->nkeys[depth]++;
+    }
+}
+
+void jsl_values_mark(const jsl_VALUES *values)
+{
+    if (values->ptr) {
+        rb_gc_mark_locations(values->ptr, values->ptr + values->len);
+    }
+}
+
+void jsl_values_free(jsl_VALUES *values)
+{
+    ruby_xfree(values->ptr);
+    values->ptr = NULL;
+    values->len = values->capa = 0;
+}
+
+static void jsl_values_push(jsl_VALUES *values, VALUE val)
+{
+    if (values->len == values->capa) {
+        size_t capa = values->capa ? values->capa * 2 : 64;
+        REALLOC_N(values->ptr, VALUE, capa);
+        values->capa = capa;
+    }
+    values->ptr[values->len++] = val;
+}
+
+/* Containers own the last nelem values, for objects keys and values alternate */
+static VALUE jsl_values_pop_list(jsl_VALUES *values, size_t nelem)
+{
+    VALUE ary = rb_ary_new_from_values((long)nelem, values->ptr + values->len - nelem);
+    values->len -= nelem;
+    return ary;
+}
+
+static VALUE jsl_values_pop_object(jsl_VALUES *values, size_t nelem)
+{
+    VALUE hash = rb_hash_new_capa((long)nelem / 2);
+    rb_hash_bulk_insert((long)nelem, values->ptr + values->len - nelem, hash);
+    values->len -= nelem;
+    return hash;
+}
+
 void jsl_raise_at(jsonsl_error_t code, const char *message, const char *file, int line)
 {
     VALUE exc, str;
@@ -59,12 +156,8 @@ static void jsl_jsonsl_push_callback(jsonsl_t jsn, jsonsl_action_t action, struc
         case JSONSL_T_STRING:
             break;
         case JSONSL_T_HKEY:
-            break;
         case JSONSL_T_LIST:
-            state->val = rb_ary_new();
-            break;
         case JSONSL_T_OBJECT:
-            state->val = rb_hash_new();
             break;
         default:
             jsl_raise_msg("unexpected state type in POP callback");
@@ -75,90 +168,797 @@ static void jsl_jsonsl_push_callback(jsonsl_t jsn, jsonsl_action_t action, struc
     (void)action;
 }
 
+/*
+ * Returns 1 when the bytes hold non-ASCII characters, 0 for plain ASCII, and
+ * -1 when they are not well-formed UTF-8 (overlong forms, surrogates and
+ * code points above U+10FFFF included). Pure C, so it is safe without the GVL.
+ */
+int jsl_utf8_scan(const char *ptr, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)ptr, *end = p + len;
+    int nonascii = 0;
+
+    while (p < end) {
+        unsigned char lo = 0x80, hi = 0xBF;
+        size_t n, ii;
+
+        if (*p < 0x80) {
+            p++;
+            continue;
+        }
+        nonascii = 1;
+        if (*p >= 0xC2 && *p <= 0xDF) {
+            n = 1;
+        } else if (*p >= 0xE0 && *p <= 0xEF) {
+            n = 2;
+            lo = *p == 0xE0 ? 0xA0 : 0x80;
+            hi = *p == 0xED ? 0x9F : 0xBF;
+        } else if (*p >= 0xF0 && *p <= 0xF4) {
+            n = 3;
+            lo = *p == 0xF0 ? 0x90 : 0x80;
+            hi = *p == 0xF4 ? 0x8F : 0xBF;
+        } else {
+            return -1;
+        }
+        if ((size_t)(end - p) <= n || p[1] < lo || p[1] > hi) {
+            return -1;
+        }
+        for (ii = 2; ii <= n; ii++) {
+            if ((p[ii] & 0xC0) != 0x80) {
+                return -1;
+            }
+        }
+        p += n + 1;
+    }
+    return nonascii;
+}
+
+static int jsl_check_utf8(const char *ptr, size_t len)
+{
+    int nonascii = jsl_utf8_scan(ptr, len);
+
+    if (nonascii < 0) {
+        jsl_raise(JSONSL_ERROR_INVALID_CODEPOINT, "invalid UTF-8 in string");
+    }
+    return nonascii;
+}
+
+/*
+ * Strings are UTF-8. Raw bytes are copied as is, so unless the caller knows
+ * that they are ASCII, they are checked to be valid UTF-8 first. Either way
+ * the coderange is set right away, so Ruby does not have to scan the string
+ * on first use: 7BIT, or VALID when the source or \u escapes produced
+ * non-ASCII characters (the unescaper only writes well-formed UTF-8).
+ */
+VALUE jsl_value_string(const char *ptr, size_t len, int escaped, int ascii)
+{
+    VALUE str;
+    size_t nlen;
+    unsigned oflags = 0;
+    jsonsl_error_t err = JSONSL_ERROR_SUCCESS;
+    int nonascii = ascii ? 0 : jsl_check_utf8(ptr, len);
+
+    if (!escaped) {
+        str = rb_utf8_str_new(ptr, len);
+        ENC_CODERANGE_SET(str, nonascii ? ENC_CODERANGE_VALID : ENC_CODERANGE_7BIT);
+        return str;
+    }
+    /* unescaped value is never longer than the source, decode in place */
+    str = rb_str_buf_new(len);
+    rb_enc_associate_index(str, rb_utf8_encindex());
+    nlen = jsonsl_util_unescape_ex(ptr, RSTRING_PTR(str), len, NULL, &oflags, &err, NULL);
+    if (err != JSONSL_ERROR_SUCCESS) {
+        jsl_raise(err, "unable to unescape string");
+    }
+    rb_str_set_len(str, nlen);
+    ENC_CODERANGE_SET(str, (nonascii || (oflags & JSONSL_SPECIALf_NONASCII)) ? ENC_CODERANGE_VALID
+                                                                            : ENC_CODERANGE_7BIT);
+    return str;
+}
+
+VALUE jsl_value_key(const char *ptr, size_t len, int escaped, int ascii, int symbolize)
+{
+    rb_encoding *enc = rb_utf8_encoding();
+    VALUE key;
+    ID id;
+
+    if (escaped) {
+        key = jsl_value_string(ptr, len, escaped, ascii);
+        if (symbolize) {
+            return rb_str_intern(key);
+        }
+#ifdef HAVE_RB_STR_TO_INTERNED_STR
+        return rb_str_to_interned_str(key);
+#else
+        return rb_str_freeze(key);
+#endif
+    }
+    if (!ascii) {
+        jsl_check_utf8(ptr, len);
+    }
+    if (symbolize) {
+        id = rb_check_id_cstr(ptr, len, enc);
+        if (id) {
+            return ID2SYM(id);
+        }
+        return rb_str_intern(jsl_value_string(ptr, len, 0, ascii));
+    }
+#ifdef HAVE_RB_ENC_INTERNED_STR
+    return rb_enc_interned_str(ptr, len, enc);
+#else
+    return rb_str_freeze(jsl_value_string(ptr, len, 0, ascii));
+#endif
+}
+
+/*
+ * With freeze: true strings are built by jsl_value_key (interned, so equal
+ * values share one object) and containers are frozen once they are filled.
+ * Everything they hold is frozen by then, so they are marked shareable right
+ * away, and Ractor.make_shareable does not have to walk the result again.
+ */
+VALUE jsl_value_freeze(VALUE obj)
+{
+    rb_obj_freeze(obj);
+#ifdef HAVE_RB_RACTOR_MAKE_SHAREABLE
+    /* the children were made shareable first, so this only checks them */
+    rb_ractor_make_shareable(obj);
+#endif
+    return obj;
+}
+
+/*
+ * Integers of up to 19 digits always fit into the uint64_t accumulated by
+ * the lexer, longer ones might have wrapped and are converted from text.
+ */
+static VALUE jsl_value_integer(const char *ptr, size_t len, uint64_t value)
+{
+    int negative = *ptr == '-';
+
+    if (len - negative <= 19) {
+        if (!negative) {
+            return ULL2NUM(value);
+        } else if (value <= (uint64_t)INT64_MAX) {
+            return LL2NUM(-(int64_t)value);
+        }
+    }
+    return rb_str_to_inum(rb_str_new(ptr, len), 10, 0);
+}
+
+/*
+ * Clinger's fast path: when both the mantissa and the power of ten are
+ * exactly representable as doubles, a single multiplication or division is
+ * correctly rounded. It needs double arithmetic without excess precision.
+ */
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define JSL_FLOAT_FASTPATH 1
+static const double jsl_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define JSL_POW10_MAX 22
+#define JSL_MANTISSA_MAX (1ULL << 53)
+#endif
+
+/*
+ * The lexer hands over the mantissa with all its digits and the number of
+ * digits after the decimal point, the exponent is read from the tail of the
+ * token. Anything the fast path cannot do exactly is converted from a
+ * bounded copy of the token.
+ */
+static VALUE jsl_value_float(const char *ptr, size_t len, unsigned special_flags, uint64_t mantissa,
+                             unsigned nfrac)
+{
+    char buf[64];
+    VALUE tmp;
+    double val;
+#ifdef JSL_FLOAT_FASTPATH
+    int negative = *ptr == '-';
+    size_t ndigits = len, end = len;
+    long exponent = 0;
+
+    if (special_flags & JSONSL_SPECIALf_EXPONENT) {
+        while ((unsigned)(ptr[end - 1] - '0') < 10) {
+            end--;
+        }
+        if (len - end > 4) {
+            goto slow;
+        }
+        for (ndigits = end; ndigits < len; ndigits++) {
+            exponent = exponent * 10 + (ptr[ndigits] - '0');
+        }
+        if (ptr[end - 1] == '-') {
+            exponent = -exponent;
+        }
+        ndigits = end - 1 - (ptr[end - 1] == '-' || ptr[end - 1] == '+');
+    }
+    ndigits -= negative + ((special_flags & JSONSL_SPECIALf_FLOAT) != 0);
+    if (!(special_flags & JSONSL_SPECIALf_FLOAT)) {
+        nfrac = 0;
+    }
+    exponent -= nfrac;
+    if (ndigits > 19 || mantissa > JSL_MANTISSA_MAX) {
+        goto slow;
+    }
+    if (exponent > JSL_POW10_MAX) {
+        /* 12e30 is the same as 12000000000e22 when the mantissa stays exact */
+        for (; exponent > JSL_POW10_MAX && mantissa <= JSL_MANTISSA_MAX / 10; exponent--) {
+            mantissa *= 10;
+        }
+        if (exponent > JSL_POW10_MAX) {
+            goto slow;
+        }
+    }
+    val = (double)mantissa;
+    if (mantissa == 0) {
+        /* nothing, keeps the sign of -0.0 */
+    } else if (exponent < 0) {
+        if (exponent < -JSL_POW10_MAX) {
+            goto slow;
+        }
+        val /= jsl_pow10[-exponent];
+    } else {
+        val *= jsl_pow10[exponent];
+    }
+    return rb_float_new(negative ? -val : val);
+
+slow:
+#else
+    (void)special_flags;
+    (void)mantissa;
+    (void)nfrac;
+#endif
+    if (len < sizeof(buf)) {
+        memcpy(buf, ptr, len);
+        buf[len] = '\0';
+        return rb_float_new(ruby_strtod(buf, NULL));
+    }
+    tmp = rb_str_new(ptr, len);
+    val = ruby_strtod(RSTRING_PTR(tmp), NULL);
+    RB_GC_GUARD(tmp);
+    return rb_float_new(val);
+}
+
+VALUE jsl_value_special(const char *ptr, size_t len, unsigned special_flags, uint64_t value, unsigned nfrac)
+{
+    if (special_flags & JSONSL_SPECIALf_NUMNOINT) {
+        return jsl_value_float(ptr, len, special_flags, value, nfrac);
+    } else if (special_flags & JSONSL_SPECIALf_NUMERIC) {
+        return jsl_value_integer(ptr, len, value);
+    } else if (special_flags & JSONSL_SPECIALf_TRUE) {
+        return Qtrue;
+    } else if (special_flags & JSONSL_SPECIALf_FALSE) {
+        return Qfalse;
+    } else if (special_flags & JSONSL_SPECIALf_NULL) {
+        return Qnil;
+    }
+    jsl_raise_msg("invalid special value");
+    return Qnil;
+}
+
 static void jsl_jsonsl_pop_callback(jsonsl_t jsn, jsonsl_action_t action, struct jsonsl_state_st *state,
                                     const jsonsl_char_t *at)
 {
     struct jsonsl_state_st *last_state = jsonsl_last_state(jsn, state);
+    /* the input might have been fed in chunks, but the token is contiguous up to 'at' */
+    const char *begin = (const char *)at - (jsn->pos - state->pos_begin);
+    jsl_CONTEXT *ctx = (jsl_CONTEXT *)jsn->data;
     VALUE val = Qnil;
 
     switch (state->type) {
         case JSONSL_T_SPECIAL:
-            if (state->special_flags & JSONSL_SPECIALf_NUMNOINT) {
-                val = rb_float_new(strtod((char *)jsn->base + state->pos_begin, NULL));
-            } else if (state->special_flags & JSONSL_SPECIALf_NUMERIC) {
-                val = rb_cstr2inum((char *)jsn->base + state->pos_begin, 10);
-            } else if (state->special_flags & JSONSL_SPECIALf_TRUE) {
-                val = Qtrue;
-            } else if (state->special_flags & JSONSL_SPECIALf_FALSE) {
-                val = Qfalse;
-            } else if (state->special_flags & JSONSL_SPECIALf_NULL) {
-                val = Qnil;
-            } else {
-                jsl_raise_msg("invalid special value");
-            }
+            val = jsl_value_special(begin, at - begin, state->special_flags, JSONSL_NUMERIC_VALUE(state),
+                                    JSONSL_NUMERIC_FRACTION(state));
             break;
         case JSONSL_T_STRING:
-            val = rb_str_new((char *)jsn->base + state->pos_begin + 1, at - ((char *)jsn->base + state->pos_begin + 1));
+            if (ctx->freeze) {
+                val = jsl_value_key(begin + 1, at - (begin + 1), state->nescapes,
+                                    !(state->special_flags & JSONSL_SPECIALf_NONASCII), 0);
+            } else {
+                val = jsl_value_string(begin + 1, at - (begin + 1), state->nescapes,
+                                       !(state->special_flags & JSONSL_SPECIALf_NONASCII));
+            }
             break;
         case JSONSL_T_HKEY:
-            val = rb_str_new((char *)jsn->base + state->pos_begin + 1, at - ((char *)jsn->base + state->pos_begin + 1));
+            val = jsl_shapes_lookup(&ctx->shapes, last_state->level, (last_state->nelem - 1) / 2, begin + 1,
+                                    at - (begin + 1));
+            if (val == Qundef) {
+                val = jsl_value_key(begin + 1, at - (begin + 1), state->nescapes,
+                                    !(state->special_flags & JSONSL_SPECIALf_NONASCII), ctx->symbolize_names);
+                jsl_shapes_store(&ctx->shapes, last_state->level, (last_state->nelem - 1) / 2, begin + 1,
+                                 at - (begin + 1), val);
+            }
             break;
         case JSONSL_T_LIST:
+            val = jsl_values_pop_list(ctx->values, state->nelem);
+            if (ctx->freeze) {
+                jsl_value_freeze(val);
+            }
+            break;
         case JSONSL_T_OBJECT:
-            val = (VALUE)state->val;
+            val = jsl_values_pop_object(ctx->values, state->nelem);
+            if (ctx->freeze) {
+                jsl_value_freeze(val);
+            }
             break;
         default:
             jsl_raise_msg("unexpected state type in PUSH callback");
     }
     if (!last_state) {
-        jsn->data = (void *)val;
-    } else if (last_state->type == JSONSL_T_LIST) {
-        rb_ary_push(last_state->val, val);
-    } else if (last_state->type == JSONSL_T_OBJECT) {
-        Check_Type(last_state->val, T_HASH);
-        if (state->type == JSONSL_T_HKEY) {
-            last_state->pkey = val;
-        } else {
-            rb_hash_aset(last_state->val, last_state->pkey, val);
-        }
+        ctx->result = val;
+    } else if (last_state->type == JSONSL_T_LIST || last_state->type == JSONSL_T_OBJECT) {
+        jsl_values_push(ctx->values, val);
     } else {
         jsl_raise_msg("unable to add value to non container type");
     }
     (void)action;
 }
 
-static VALUE jsl_jsonsl_parse(int argc, VALUE *argv, VALUE self)
+static VALUE jsl_metric_key(const char *name)
+{
+    char buf[32];
+    size_t ii;
+
+    for (ii = 0; name[ii] && ii < sizeof(buf) - 1; ii++) {
+        buf[ii] = (char)TOLOWER(name[ii]);
+    }
+    buf[ii] = '\0';
+    return ID2SYM(rb_intern(buf));
+}
+
+VALUE jsl_metrics_hash(const struct jsonsl_metrics_st *metrics, VALUE hash)
+{
+    if (hash == Qnil) {
+        hash = rb_hash_new();
+    }
+    if (metrics) {
+#define X(m) \
+        rb_hash_aset(hash, jsl_metric_key(#m), ULONG2NUM(metrics->metric_##m));
+        JSONSL_XMETRICS
+#undef X
+    }
+    return hash;
+}
+
+jsonsl_t jsl_lexer_new(VALUE nlevels)
 {
     jsonsl_t jsn;
-    VALUE nlevels = Qnil, str = Qnil;
 
-    rb_scan_args(argc, argv, "11", &str, &nlevels);
-    Check_Type(str, T_STRING);
     if (nlevels != Qnil) {
         Check_Type(nlevels, T_FIXNUM);
         jsn = jsonsl_new(FIX2INT(nlevels));
     } else {
         jsn = jsonsl_new(JSONSL_MAX_LEVELS);
     }
-    jsonsl_reset(jsn);
-    jsn->data = (void *)Qnil;
+    if (jsn == NULL) {
+        rb_raise(rb_eArgError, "invalid nesting level: %+" PRIsVALUE, nlevels);
+    }
+    return jsn;
+}
+
+void jsl_lexer_setup(jsonsl_t jsn)
+{
     jsonsl_enable_all_callbacks(jsn);
     jsn->action_callback_PUSH = jsl_jsonsl_push_callback;
     jsn->action_callback_POP = jsl_jsonsl_pop_callback;
     jsn->error_callback = jsl_jsonsl_error_callback;
-    jsonsl_feed(jsn, RSTRING_PTR(str), RSTRING_LEN(str));
+}
+
+static void jsl_lexer_start(jsonsl_t jsn, jsl_CONTEXT *ctx, const jsl_OPTIONS *options, jsl_VALUES *values)
+{
+    ctx->result = Qnil;
+    ctx->symbolize_names = options->symbolize_names;
+    ctx->freeze = options->freeze;
+    ctx->values = values;
+    values->len = 0;
+    jsl_shapes_reset(&ctx->shapes);
+    jsonsl_reset(jsn);
+    jsn->data = ctx;
+    jsonsl_enable_metrics(jsn, options->stats != Qnil);
+}
+
+static VALUE jsl_lexer_finish(jsonsl_t jsn, jsl_CONTEXT *ctx, const jsl_OPTIONS *options)
+{
+    jsn->data = NULL;
     if (jsn->level != 0) {
         jsl_raise_msg("unexpected end of data");
     }
+    if (options->stats != Qnil) {
+        jsl_metrics_hash(jsn->metrics, options->stats);
+    }
+    return ctx->result;
+}
+
+/*
+ * The lexer builds values from its callbacks, so it cannot run without the
+ * GVL. Large inputs are fed in slices instead, and pending interrupts are
+ * checked in between, so the timer hands the GVL to waiting threads. The
+ * input must not change meanwhile: callers pass frozen strings or maps.
+ */
+VALUE jsl_lexer_parse_buf(jsonsl_t jsn, const char *buf, size_t len, const jsl_OPTIONS *options,
+                          jsl_VALUES *values)
+{
+    jsl_CONTEXT ctx;
+    size_t offset, nbytes;
+
+    jsl_lexer_start(jsn, &ctx, options, values);
+    if (len < options->nogvl_min) {
+        jsonsl_feed(jsn, buf, len);
+    } else {
+        for (offset = 0; offset < len; offset += nbytes) {
+            nbytes = len - offset < JSL_CHUNK_SIZE ? len - offset : JSL_CHUNK_SIZE;
+            jsonsl_feed(jsn, buf + offset, nbytes);
+            rb_thread_check_ints();
+        }
+    }
+    return jsl_lexer_finish(jsn, &ctx, options);
+}
+
+VALUE jsl_lexer_parse(jsonsl_t jsn, VALUE str, const jsl_OPTIONS *options, jsl_VALUES *values)
+{
+    return jsl_lexer_parse_buf(jsn, RSTRING_PTR(str), RSTRING_LEN(str), options, values);
+}
+
+long jsl_chunk_size(VALUE opts)
+{
+    VALUE val = opts == Qnil ? Qnil : rb_hash_aref(opts, jsl_sym_chunk_size);
+    long chunk_size = val == Qnil ? JSL_CHUNK_SIZE : NUM2LONG(val);
+
+    if (chunk_size <= 0) {
+        rb_raise(rb_eArgError, "chunk size must be positive");
+    }
+    return chunk_size;
+}
+
+/* Reads the next chunk into outbuf, returns nil at the end of the stream */
+VALUE jsl_io_read(VALUE io, long chunk_size, VALUE outbuf)
+{
+    VALUE chunk = rb_funcall(io, jsl_id_read, 2, LONG2NUM(chunk_size), outbuf);
+
+    if (chunk != Qnil) {
+        Check_Type(chunk, T_STRING);
+        if (RSTRING_LEN(chunk) == 0) {
+            return Qnil;
+        }
+    }
+    return chunk;
+}
+
+/*
+ * Values are sliced straight from the input, so the bytes of the token
+ * which is still open at the end of a chunk are moved to the front of the
+ * buffer, and the next chunk is appended right after them.
+ */
+VALUE jsl_lexer_parse_io(jsonsl_t jsn, VALUE io, long chunk_size, const jsl_OPTIONS *options, jsl_VALUES *values)
+{
+    jsl_CONTEXT ctx;
+    VALUE buf = rb_str_tmp_new(chunk_size), outbuf = rb_str_buf_new(chunk_size), chunk;
+    long capa = chunk_size, carry = 0, len;
+    size_t offset = 0;
+    struct jsonsl_state_st *state;
+
+    jsl_lexer_start(jsn, &ctx, options, values);
+    while ((chunk = jsl_io_read(io, chunk_size, outbuf)) != Qnil) {
+        len = RSTRING_LEN(chunk);
+        if (carry + len > capa) {
+            capa = carry + len;
+            rb_str_resize(buf, capa);
+        }
+        memcpy(RSTRING_PTR(buf) + carry, RSTRING_PTR(chunk), len);
+        /* cached key shapes point into the buffer */
+        jsl_shapes_reset(&ctx.shapes);
+        jsonsl_feed(jsn, RSTRING_PTR(buf) + carry, len);
+
+        state = jsn->stack + jsn->level;
+        if (jsn->level > 0 && (state->type & JSONSL_Tf_STRINGY || state->type == JSONSL_T_SPECIAL)) {
+            carry = (long)(jsn->pos - state->pos_begin);
+            memmove(RSTRING_PTR(buf), RSTRING_PTR(buf) + (state->pos_begin - offset), carry);
+            offset = state->pos_begin;
+        } else {
+            carry = 0;
+            offset = jsn->pos;
+        }
+    }
+    RB_GC_GUARD(buf);
+    RB_GC_GUARD(outbuf);
+    return jsl_lexer_finish(jsn, &ctx, options);
+}
+
+void jsl_parse_opts(VALUE opts, jsl_OPTIONS *options)
+{
+    options->mode = Qnil;
+    options->stats = Qnil;
+    options->symbolize_names = 0;
+    options->freeze = 0;
+    options->nogvl_min = JSL_NOGVL_MIN;
+    if (opts != Qnil) {
+        VALUE release_gvl;
+
+        options->mode = rb_hash_aref(opts, jsl_sym_mode);
+        options->stats = rb_hash_aref(opts, jsl_sym_stats);
+        if (options->stats != Qnil) {
+            Check_Type(options->stats, T_HASH);
+        }
+        options->symbolize_names = RTEST(rb_hash_aref(opts, jsl_sym_symbolize_names));
+        options->freeze = RTEST(rb_hash_aref(opts, jsl_sym_freeze));
+        release_gvl = rb_hash_aref(opts, jsl_sym_release_gvl);
+        if (release_gvl == Qtrue) {
+            options->nogvl_min = 0;
+        } else if (release_gvl == Qfalse) {
+            options->nogvl_min = SIZE_MAX;
+        } else if (release_gvl != Qnil) {
+            options->nogvl_min = NUM2SIZET(release_gvl);
+        }
+    }
+    if (options->mode != Qnil && options->mode != jsl_sym_lexer && options->mode != jsl_sym_index) {
+        rb_raise(rb_eArgError, "unknown parse mode: %+" PRIsVALUE, options->mode);
+    }
+    if (options->mode == jsl_sym_index && options->stats != Qnil) {
+        /* the counters describe the paths taken by the streaming lexer */
+        rb_raise(rb_eArgError, "stats are collected only in lexer mode");
+    }
+}
+
+/*
+ * The index and the lexer do not accept exactly the same documents (the
+ * lexer is more lenient with some numbers and top-level scalars), so the
+ * index is used only when asked for, never picked by the size of the input.
+ */
+int jsl_index_wanted(size_t len, const jsl_OPTIONS *options)
+{
+    return options->mode == jsl_sym_index && jsl_index_available() && len < UINT32_MAX;
+}
+
+struct jsl_parse_args {
+    jsonsl_t jsn;
+    VALUE str;
+    VALUE holder;
+    jsl_VALUES *values;
+    jsl_OPTIONS options;
+    long chunk_size;
+};
+
+static void jsl_values_holder_mark(void *ptr)
+{
+    jsl_values_mark(ptr);
+}
+
+static void jsl_values_holder_free(void *ptr)
+{
+    jsl_values_free(ptr);
+    ruby_xfree(ptr);
+}
+
+/* Hidden object, so that the values are marked until the parse is over */
+VALUE jsl_values_new(jsl_VALUES **values)
+{
+    return Data_Make_Struct(0, jsl_VALUES, jsl_values_holder_mark, jsl_values_holder_free, *values);
+}
+
+static VALUE jsl_parse_body(VALUE arg)
+{
+    struct jsl_parse_args *args = (struct jsl_parse_args *)arg;
+    return jsl_lexer_parse(args->jsn, args->str, &args->options, args->values);
+}
+
+static VALUE jsl_parse_io_body(VALUE arg)
+{
+    struct jsl_parse_args *args = (struct jsl_parse_args *)arg;
+    return jsl_lexer_parse_io(args->jsn, args->str, args->chunk_size, &args->options, args->values);
+}
+
+static VALUE jsl_parse_ensure(VALUE arg)
+{
+    struct jsl_parse_args *args = (struct jsl_parse_args *)arg;
+    jsonsl_destroy(args->jsn);
+    jsl_values_free(args->values);
+    RB_GC_GUARD(args->holder);
+    return Qnil;
+}
+
+static VALUE jsl_jsonsl_parse(int argc, VALUE *argv, VALUE self)
+{
+    struct jsl_parse_args args;
+    VALUE nlevels = Qnil, str = Qnil, opts = Qnil;
+
+    rb_scan_args(argc, argv, "11:", &str, &nlevels, &opts);
+    Check_Type(str, T_STRING);
+    if (nlevels != Qnil) {
+        Check_Type(nlevels, T_FIXNUM);
+    }
+    jsl_parse_opts(opts, &args.options);
+    /* other threads may change str while the GVL is released */
+    str = rb_str_new_frozen(str);
+    if (jsl_index_wanted(RSTRING_LEN(str), &args.options)) {
+        VALUE res = jsl_index_parse(RSTRING_PTR(str), RSTRING_LEN(str),
+                                    nlevels == Qnil ? JSONSL_MAX_LEVELS : FIX2INT(nlevels), &args.options);
+        RB_GC_GUARD(str);
+        return res;
+    }
+
+    args.holder = jsl_values_new(&args.values);
+    args.jsn = jsl_lexer_new(nlevels);
+    args.str = str;
+    jsl_lexer_setup(args.jsn);
+    (void)self;
+    return rb_ensure(jsl_parse_body, (VALUE)&args, jsl_parse_ensure, (VALUE)&args);
+}
+
+/*
+ * Reads the document from an IO in chunks of chunk_size bytes. It always
+ * uses the streaming lexer, and keeps only the currently open token of the
+ * input in memory.
+ */
+static VALUE jsl_jsonsl_parse_io(int argc, VALUE *argv, VALUE self)
+{
+    struct jsl_parse_args args;
+    VALUE nlevels = Qnil, io = Qnil, opts = Qnil;
+
+    rb_scan_args(argc, argv, "11:", &io, &nlevels, &opts);
+    if (nlevels != Qnil) {
+        Check_Type(nlevels, T_FIXNUM);
+    }
+    jsl_parse_opts(opts, &args.options);
+    args.chunk_size = jsl_chunk_size(opts);
+    args.holder = jsl_values_new(&args.values);
+    args.jsn = jsl_lexer_new(nlevels);
+    args.str = io;
+    jsl_lexer_setup(args.jsn);
+    (void)self;
+    return rb_ensure(jsl_parse_io_body, (VALUE)&args, jsl_parse_ensure, (VALUE)&args);
+}
+
+static int jsl_validate_error_callback(jsonsl_t jsn, jsonsl_error_t err, struct jsonsl_state_st *state, char *at)
+{
+    jsn->data = (void *)(size_t)err;
+    (void)at;
+    (void)state;
+    return 0;
+}
+
+/*
+ * The lexer does not look inside \u escapes or non-ASCII bytes, so strings
+ * are checked the same way parse builds them: raw bytes must be valid UTF-8,
+ * and strings with escapes are unescaped into a scratch buffer with the same
+ * routine. Pure C, as it might run without the GVL.
+ */
+static void jsl_validate_pop_callback(jsonsl_t jsn, jsonsl_action_t action, struct jsonsl_state_st *state,
+                                      const jsonsl_char_t *at)
+{
+    const char *begin = (const char *)at - (jsn->pos - state->pos_begin) + 1;
+    size_t len = (const char *)at - begin;
+    char buf[256], *out = buf;
+    jsonsl_error_t err = JSONSL_ERROR_SUCCESS;
+
+    (void)action;
+    if ((state->special_flags & JSONSL_SPECIALf_NONASCII) && jsl_utf8_scan(begin, len) < 0) {
+        jsn->data = (void *)(size_t)JSONSL_ERROR_INVALID_CODEPOINT;
+        jsonsl_stop(jsn);
+        return;
+    }
+    if (state->nescapes == 0) {
+        return;
+    }
+    if (len > sizeof(buf) && (out = malloc(len)) == NULL) {
+        err = JSONSL_ERROR_ENOMEM;
+    } else {
+        jsonsl_util_unescape_ex(begin, out, len, NULL, NULL, &err, NULL);
+        if (out != buf) {
+            free(out);
+        }
+    }
+    if (err != JSONSL_ERROR_SUCCESS) {
+        jsn->data = (void *)(size_t)err;
+        jsonsl_stop(jsn);
+    }
+}
+
+struct jsl_feed_args {
+    jsonsl_t jsn;
+    const char *ptr;
+    size_t len;
+};
+
+static void *jsl_feed_nogvl(void *arg)
+{
+    struct jsl_feed_args *args = arg;
+    jsonsl_feed(args->jsn, args->ptr, args->len);
+    return NULL;
+}
+
+/* There are no callbacks into Ruby, so large inputs are lexed without the GVL */
+static int jsl_validate(jsonsl_t jsn, VALUE str, const jsl_OPTIONS *options)
+{
+    if (TYPE(str) != T_STRING) {
+        return 0;
+    }
+    jsonsl_reset(jsn);
+    jsn->data = (void *)(size_t)JSONSL_ERROR_SUCCESS;
+    if ((size_t)RSTRING_LEN(str) >= options->nogvl_min) {
+        struct jsl_feed_args args;
+        str = rb_str_new_frozen(str);
+        args.jsn = jsn;
+        args.ptr = RSTRING_PTR(str);
+        args.len = RSTRING_LEN(str);
+        rb_thread_call_without_gvl(jsl_feed_nogvl, &args, NULL, NULL);
+        RB_GC_GUARD(str);
+    } else {
+        jsonsl_feed(jsn, RSTRING_PTR(str), RSTRING_LEN(str));
+    }
+    return (size_t)jsn->data == JSONSL_ERROR_SUCCESS && jsn->level == 0 && jsn->stack[0].nelem > 0;
+}
+
+static jsonsl_t jsl_validate_new(VALUE nlevels)
+{
+    jsonsl_t jsn = jsl_lexer_new(nlevels);
+    jsn->error_callback = jsl_validate_error_callback;
+    jsn->action_callback_POP = jsl_validate_pop_callback;
+    jsn->call_STRING = 1;
+    jsn->call_HKEY = 1;
+    return jsn;
+}
+
+static VALUE jsl_jsonsl_valid_p(int argc, VALUE *argv, VALUE self)
+{
+    jsl_OPTIONS options;
+    jsonsl_t jsn;
+    VALUE str = Qnil, nlevels = Qnil, opts = Qnil;
+    int valid;
+
+    rb_scan_args(argc, argv, "11:", &str, &nlevels, &opts);
+    jsl_parse_opts(opts, &options);
+    jsn = jsl_validate_new(nlevels);
+    valid = jsl_validate(jsn, str, &options);
+    jsonsl_destroy(jsn);
+    (void)self;
+    return valid ? Qtrue : Qfalse;
+}
+
+static VALUE jsl_jsonsl_validate_all(int argc, VALUE *argv, VALUE self)
+{
+    jsl_OPTIONS options;
+    jsonsl_t jsn;
+    VALUE strs = Qnil, nlevels = Qnil, opts = Qnil, res;
+    long ii, len;
+
+    rb_scan_args(argc, argv, "11:", &strs, &nlevels, &opts);
+    Check_Type(strs, T_ARRAY);
+    jsl_parse_opts(opts, &options);
+    len = RARRAY_LEN(strs);
+    res = rb_ary_new_capa(len);
+    jsn = jsl_validate_new(nlevels);
+    for (ii = 0; ii < len; ii++) {
+        rb_ary_push(res, jsl_validate(jsn, RARRAY_AREF(strs, ii), &options) ? Qtrue : Qfalse);
+    }
+    jsonsl_destroy(jsn);
     (void)self;
-    return (VALUE)jsn->data;
+    return res;
 }
 
 void Init_jsonsl_ext()
 {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    /* all parser state lives in the instances, the globals are set only here */
+    rb_ext_ractor_safe(true);
+#endif
     jsl_mJSONSL = rb_define_module("JSONSL");
     rb_define_const(jsl_mJSONSL, "REVISION", rb_str_freeze(rb_str_new_cstr(JSONSL_REVISION)));
     jsl_eError = rb_const_get(jsl_mJSONSL, rb_intern("Error"));
+    jsl_sym_mode = ID2SYM(rb_intern("mode"));
+    jsl_sym_lexer = ID2SYM(rb_intern("lexer"));
+    jsl_sym_index = ID2SYM(rb_intern("index"));
+    jsl_sym_stats = ID2SYM(rb_intern("stats"));
+    jsl_sym_symbolize_names = ID2SYM(rb_intern("symbolize_names"));
+    jsl_sym_freeze = ID2SYM(rb_intern("freeze"));
+    jsl_sym_chunk_size = ID2SYM(rb_intern("chunk_size"));
+    jsl_sym_release_gvl = ID2SYM(rb_intern("release_gvl"));
+    jsl_id_read = rb_intern("read");
     rb_define_singleton_method(jsl_mJSONSL, "parse", jsl_jsonsl_parse, -1);
+    rb_define_singleton_method(jsl_mJSONSL, "parse_io", jsl_jsonsl_parse_io, -1);
+    rb_define_singleton_method(jsl_mJSONSL, "valid?", jsl_jsonsl_valid_p, -1);
+    rb_define_singleton_method(jsl_mJSONSL, "validate_all", jsl_jsonsl_validate_all, -1);
+    jsl_index_init();
     jsl_row_parser_init();
+    jsl_tree_parser_init();
+    jsl_file_init();
+    jsl_stream_parser_init();
 }
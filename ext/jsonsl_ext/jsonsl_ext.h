@@ -18,19 +18,134 @@
  */
 
 #include <ruby.h>
+#include <ruby/encoding.h>
+#include <ruby/util.h>
+#include <ruby/thread.h>
+#ifdef HAVE_RB_RACTOR_MAKE_SHAREABLE
+#include <ruby/ractor.h>
+#endif
+#include <float.h>
 
 #include "jsonsl.h"
 
 #ifndef JSONSL_EXT_H
 #define JSONSL_EXT_H
 
+#ifndef HAVE_RB_HASH_NEW_CAPA
+#define rb_hash_new_capa(capa) rb_hash_new()
+#endif
+
 extern VALUE jsl_mJSONSL;
 extern VALUE jsl_eError;
+extern ID jsl_id_call;
+extern VALUE jsl_cStreamParser;
+extern VALUE jsl_sym_lexer;
+extern VALUE jsl_sym_symbolize_names;
+extern VALUE jsl_sym_freeze;
+extern VALUE jsl_sym_lines;
 
 void jsl_raise_at(jsonsl_error_t code, const char *message, const char *file, int line);
 #define jsl_raise(code, message) jsl_raise_at(code, message, __FILE__, __LINE__)
 #define jsl_raise_msg(message) jsl_raise_at(0, message, __FILE__, __LINE__)
 
+int jsl_utf8_scan(const char *ptr, size_t len);
+VALUE jsl_value_string(const char *ptr, size_t len, int escaped, int ascii);
+VALUE jsl_value_key(const char *ptr, size_t len, int escaped, int ascii, int symbolize);
+VALUE jsl_value_special(const char *ptr, size_t len, unsigned special_flags, uint64_t value, unsigned nfrac);
+VALUE jsl_value_freeze(VALUE obj);
+
+/*
+ * Keys seen at each position of the last object at every depth. Arrays of
+ * rows mostly repeat the same keys in the same order, so a key is checked
+ * against the one at its position in the previous sibling before it is
+ * decoded and interned. Slots point into the input and are only valid for
+ * a single parse.
+ */
+#define JSL_SHAPE_DEPTH 16
+#define JSL_SHAPE_KEYS 32
+
+typedef struct jsl_KEY_SLOT {
+    const char *ptr;
+    size_t len;
+    VALUE key;
+} jsl_KEY_SLOT;
+
+typedef struct jsl_SHAPES {
+    unsigned char nkeys[JSL_SHAPE_DEPTH];
+    jsl_KEY_SLOT slots[JSL_SHAPE_DEPTH][JSL_SHAPE_KEYS];
+} jsl_SHAPES;
+
+void jsl_shapes_reset(jsl_SHAPES *shapes);
+void jsl_shapes_mark(const jsl_SHAPES *shapes);
+VALUE jsl_shapes_lookup(const jsl_SHAPES *shapes, unsigned depth, size_t nkey, const char *ptr, size_t len);
+void jsl_shapes_store(jsl_SHAPES *shapes, unsigned depth, size_t nkey, const char *ptr, size_t len, VALUE key);
+
+/* Inputs of this size and larger are indexed or validated without the GVL, or lexed in slices */
+#define JSL_NOGVL_MIN (1 << 20)
+
+typedef struct jsl_OPTIONS {
+    VALUE mode;
+    VALUE stats;
+    int symbolize_names;
+    int freeze;
+    size_t nogvl_min;
+} jsl_OPTIONS;
+
+int jsl_index_available(void);
+int jsl_index_wanted(size_t len, const jsl_OPTIONS *options);
+VALUE jsl_index_parse(const char *buf, size_t len, int nlevels, const jsl_OPTIONS *options);
+VALUE jsl_metrics_hash(const struct jsonsl_metrics_st *metrics, VALUE hash);
+
+/*
+ * Values waiting to be put into their containers. The object owning it must
+ * mark it, so that nothing parsed so far is collected.
+ */
+typedef struct jsl_VALUES {
+    VALUE *ptr;
+    size_t len;
+    size_t capa;
+} jsl_VALUES;
+
+void jsl_values_mark(const jsl_VALUES *values);
+void jsl_values_free(jsl_VALUES *values);
+VALUE jsl_values_new(jsl_VALUES **values);
+
+/* State of the tree builder, jsn->data points to it while parsing */
+typedef struct jsl_CONTEXT {
+    VALUE result;
+    int symbolize_names;
+    int freeze;
+    jsl_VALUES *values;
+    jsl_SHAPES shapes;
+} jsl_CONTEXT;
+
+#define JSL_CHUNK_SIZE 65536
+
+jsonsl_t jsl_lexer_new(VALUE nlevels);
+void jsl_lexer_setup(jsonsl_t jsn);
+VALUE jsl_lexer_parse(jsonsl_t jsn, VALUE str, const jsl_OPTIONS *options, jsl_VALUES *values);
+VALUE jsl_lexer_parse_buf(jsonsl_t jsn, const char *buf, size_t len, const jsl_OPTIONS *options,
+                          jsl_VALUES *values);
+VALUE jsl_lexer_parse_io(jsonsl_t jsn, VALUE io, long chunk_size, const jsl_OPTIONS *options, jsl_VALUES *values);
+void jsl_parse_opts(VALUE opts, jsl_OPTIONS *options);
+long jsl_chunk_size(VALUE opts);
+VALUE jsl_io_read(VALUE io, long chunk_size, VALUE outbuf);
+void jsl_index_init();
+
 void jsl_row_parser_init();
 
+void jsl_tree_parser_init();
+
+/* Contents of a file, memory-mapped where the platform allows it */
+typedef struct jsl_MAPPING {
+    char *ptr;
+    size_t len;
+} jsl_MAPPING;
+
+void jsl_mapping_open(jsl_MAPPING *map, VALUE path);
+void jsl_mapping_close(jsl_MAPPING *map);
+void jsl_file_init();
+
+void jsl_stream_parser_init();
+
 #endif
@@ -0,0 +1,173 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Author:: Couchbase <info@couchbase.com>
+ * Copyright:: 2018 Couchbase, Inc.
+ * License:: Apache License, Version 2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parsing of local files. The file is memory-mapped and fed to the lexer
+ * (or indexed) straight from the mapping, so it is never copied into a Ruby
+ * String. Platforms without mmap read the file into a malloc'ed buffer.
+ *
+ * The file must not be truncated while it is being parsed.
+ */
+
+#include "jsonsl_ext.h"
+
+#include <errno.h>
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#define JSL_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+void jsl_mapping_open(jsl_MAPPING *map, VALUE path)
+{
+    const char *fname;
+
+    FilePathValue(path);
+    fname = StringValueCStr(path);
+    map->ptr = NULL;
+    map->len = 0;
+#ifdef JSL_MMAP
+    {
+        struct stat st;
+        int fd, err;
+        void *ptr;
+
+        fd = open(fname, O_RDONLY);
+        if (fd < 0) {
+            rb_sys_fail_str(path);
+        }
+        if (fstat(fd, &st) < 0) {
+            goto fail;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            close(fd);
+            rb_raise(rb_eArgError, "not a regular file: %" PRIsVALUE, path);
+        }
+        if (st.st_size > 0) {
+            ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr == MAP_FAILED) {
+                goto fail;
+            }
+#ifdef MADV_SEQUENTIAL
+            madvise(ptr, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+            map->ptr = ptr;
+            map->len = (size_t)st.st_size;
+        }
+        close(fd);
+        return;
+
+    fail:
+        err = errno;
+        close(fd);
+        errno = err;
+        rb_sys_fail_str(path);
+    }
+#else
+    {
+        FILE *fp = fopen(fname, "rb");
+        long size;
+
+        if (fp == NULL) {
+            rb_sys_fail_str(path);
+        }
+        if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+            fclose(fp);
+            rb_sys_fail_str(path);
+        }
+        map->ptr = ALLOC_N(char, size + 1);
+        map->len = fread(map->ptr, 1, (size_t)size, fp);
+        fclose(fp);
+    }
+#endif
+}
+
+void jsl_mapping_close(jsl_MAPPING *map)
+{
+    if (map->ptr) {
+#ifdef JSL_MMAP
+        munmap(map->ptr, map->len);
+#else
+        ruby_xfree(map->ptr);
+#endif
+    }
+    map->ptr = NULL;
+    map->len = 0;
+}
+
+struct jsl_file_args {
+    jsl_MAPPING map;
+    jsonsl_t jsn;
+    VALUE nlevels;
+    VALUE holder;
+    jsl_VALUES *values;
+    jsl_OPTIONS options;
+};
+
+static VALUE jsl_file_parse_body(VALUE arg)
+{
+    struct jsl_file_args *args = (struct jsl_file_args *)arg;
+
+    if (jsl_index_wanted(args->map.len, &args->options)) {
+        return jsl_index_parse(args->map.ptr, args->map.len,
+                               args->nlevels == Qnil ? JSONSL_MAX_LEVELS : FIX2INT(args->nlevels), &args->options);
+    }
+    args->holder = jsl_values_new(&args->values);
+    args->jsn = jsl_lexer_new(args->nlevels);
+    jsl_lexer_setup(args->jsn);
+    return jsl_lexer_parse_buf(args->jsn, args->map.ptr, args->map.len, &args->options, args->values);
+}
+
+static VALUE jsl_file_parse_ensure(VALUE arg)
+{
+    struct jsl_file_args *args = (struct jsl_file_args *)arg;
+
+    if (args->jsn) {
+        jsonsl_destroy(args->jsn);
+    }
+    if (args->values) {
+        jsl_values_free(args->values);
+    }
+    RB_GC_GUARD(args->holder);
+    jsl_mapping_close(&args->map);
+    return Qnil;
+}
+
+static VALUE jsl_jsonsl_parse_file(int argc, VALUE *argv, VALUE self)
+{
+    struct jsl_file_args args = {{0}};
+    VALUE path = Qnil, opts = Qnil;
+
+    rb_scan_args(argc, argv, "11:", &path, &args.nlevels, &opts);
+    if (args.nlevels != Qnil) {
+        Check_Type(args.nlevels, T_FIXNUM);
+    }
+    jsl_parse_opts(opts, &args.options);
+    args.holder = Qnil;
+    jsl_mapping_open(&args.map, path);
+    (void)self;
+    return rb_ensure(jsl_file_parse_body, (VALUE)&args, jsl_file_parse_ensure, (VALUE)&args);
+}
+
+void jsl_file_init()
+{
+    rb_define_singleton_method(jsl_mJSONSL, "parse_file", jsl_jsonsl_parse_file, -1);
+}
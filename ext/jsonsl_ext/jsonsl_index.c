@@ -0,0 +1,885 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Author:: Couchbase <info@couchbase.com>
+ * Copyright:: 2018 Couchbase, Inc.
+ * License:: Apache License, Version 2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Two-stage parser for documents which are already in memory (JSONSL.parse
+ * with mode: :index).
+ *
+ * Stage one classifies the input 64 bytes at a time and produces the offsets
+ * of all structural characters, unescaped quotes and starts of scalar values.
+ * Strings are masked out with a carry-less multiplication of the quote bits.
+ * Stage two walks only those offsets and builds Ruby objects.
+ *
+ * The streaming lexer in jsonsl.c is used whenever this mode is not
+ * available (non-x86 builds or JSONSL_NO_SIMD).
+ *
+ * JSONSL.parse_lines cuts newline-delimited input into chunks at line
+ * boundaries and runs stage one for every chunk on its own native thread,
+ * with the GVL released. Stage two then builds the values of the chunks in
+ * order on the calling thread.
+ */
+
+#include "jsonsl_ext.h"
+
+#if !defined(JSONSL_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JSL_INDEX_SIMD
+#include <immintrin.h>
+#ifdef HAVE_PTHREAD_H
+#define JSL_INDEX_THREADS
+#include <pthread.h>
+#endif
+#endif
+
+static VALUE jsl_sym_threads;
+
+/*
+ * Containers are filled one value at a time, so their capacity is predicted
+ * from the previous sibling at the same depth: rows of a result set almost
+ * always have the same size.
+ */
+#define JSL_INDEX_PREDICT_DEPTH 32
+#define JSL_INDEX_PREDICT_MAX 4096
+
+/*
+ * Stage two recurses once per nesting level, so the depth is capped whatever
+ * nlevels says, to stay well inside the machine stack of a thread or fiber.
+ */
+#define JSL_INDEX_MAX_DEPTH 1024
+
+typedef struct jsl_SIZE_HINT {
+    uint16_t list;
+    uint16_t object;
+} jsl_SIZE_HINT;
+
+typedef struct jsl_INDEX {
+    const char *buf;
+    size_t len;
+    uint32_t *idx;
+    size_t nidx;
+    size_t cur;
+    unsigned int depth;
+    unsigned int max_depth;
+    int symbolize_names;
+    int freeze;
+    jsonsl_error_t err;
+    size_t errpos;
+    jsl_SIZE_HINT hints[JSL_INDEX_PREDICT_DEPTH];
+    jsl_SHAPES *shapes;
+} jsl_INDEX;
+
+static unsigned int jsl_index_max_depth(int nlevels)
+{
+    if (nlevels < 2) {
+        return 2;
+    }
+    return nlevels < JSL_INDEX_MAX_DEPTH ? (unsigned int)nlevels : JSL_INDEX_MAX_DEPTH;
+}
+
+static void jsl_index_hint(uint16_t *hint, long size)
+{
+    *hint = (uint16_t)(size < JSL_INDEX_PREDICT_MAX ? size : JSL_INDEX_PREDICT_MAX);
+}
+
+static void jsl_index_fail(jsl_INDEX *ix, jsonsl_error_t err, size_t pos)
+{
+    if (ix->err == JSONSL_ERROR_SUCCESS) {
+        ix->err = err;
+        ix->errpos = pos;
+    }
+}
+
+#ifdef JSL_INDEX_SIMD
+
+typedef struct jsl_BLOCK {
+    uint64_t bs;
+    uint64_t quote;
+    uint64_t op;
+    uint64_t ws;
+    uint64_t ctrl;
+} jsl_BLOCK;
+
+typedef void (*jsl_classify_fn)(const uint8_t *, jsl_BLOCK *);
+typedef uint64_t (*jsl_prefix_xor_fn)(uint64_t);
+
+__attribute__((target("sse2")))
+static void jsl_index_classify_sse2(const uint8_t *ptr, jsl_BLOCK *blk)
+{
+    const __m128i bs = _mm_set1_epi8('\\');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    int ii;
+
+    memset(blk, 0, sizeof(*blk));
+    for (ii = 0; ii < 4; ii++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(ptr + 16 * ii));
+        __m128i op, ws;
+        op = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')), _mm_cmpeq_epi8(v, _mm_set1_epi8('}')));
+        op = _mm_or_si128(op, _mm_cmpeq_epi8(v, _mm_set1_epi8('[')));
+        op = _mm_or_si128(op, _mm_cmpeq_epi8(v, _mm_set1_epi8(']')));
+        op = _mm_or_si128(op, _mm_cmpeq_epi8(v, _mm_set1_epi8(':')));
+        op = _mm_or_si128(op, _mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+        ws = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+        ws = _mm_or_si128(ws, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+        ws = _mm_or_si128(ws, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+        blk->bs |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, bs)) << (16 * ii);
+        blk->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << (16 * ii);
+        blk->op |= (uint64_t)(uint16_t)_mm_movemask_epi8(op) << (16 * ii);
+        blk->ws |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << (16 * ii);
+        blk->ctrl |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl)) << (16 * ii);
+    }
+}
+
+__attribute__((target("avx2")))
+static void jsl_index_classify_avx2(const uint8_t *ptr, jsl_BLOCK *blk)
+{
+    const __m256i bs = _mm256_set1_epi8('\\');
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i ctrl = _mm256_set1_epi8(0x1f);
+    int ii;
+
+    memset(blk, 0, sizeof(*blk));
+    for (ii = 0; ii < 2; ii++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(ptr + 32 * ii));
+        __m256i op, ws;
+        op = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}')));
+        op = _mm256_or_si256(op, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')));
+        op = _mm256_or_si256(op, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(']')));
+        op = _mm256_or_si256(op, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')));
+        op = _mm256_or_si256(op, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')));
+        ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        ws = _mm256_or_si256(ws, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+        ws = _mm256_or_si256(ws, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+        blk->bs |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, bs)) << (32 * ii);
+        blk->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quote)) << (32 * ii);
+        blk->op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(op) << (32 * ii);
+        blk->ws |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ws) << (32 * ii);
+        blk->ctrl |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl))
+                     << (32 * ii);
+    }
+}
+
+static uint64_t jsl_index_prefix_xor_shift(uint64_t bits)
+{
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint64_t jsl_index_prefix_xor_clmul(uint64_t bits)
+{
+    __m128i all_ones = _mm_set1_epi8((char)0xFF);
+    __m128i result = _mm_clmulepi64_si128(_mm_set_epi64x(0, (long long)bits), all_ones, 0);
+    return (uint64_t)_mm_cvtsi128_si64(result);
+}
+
+/* Characters which follow an odd-length run of backslashes */
+static uint64_t jsl_index_find_escaped(uint64_t bs, uint64_t *prev_escaped)
+{
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    uint64_t follows_escape, odd_starts, even_starts;
+
+    bs &= ~*prev_escaped;
+    follows_escape = bs << 1 | *prev_escaped;
+    odd_starts = bs & ~even_bits & ~follows_escape;
+    even_starts = odd_starts + bs;
+    *prev_escaped = even_starts < odd_starts;
+    return (even_bits ^ (even_starts << 1)) & follows_escape;
+}
+
+static jsl_classify_fn jsl_index_classify = NULL;
+static jsl_prefix_xor_fn jsl_index_prefix_xor = jsl_index_prefix_xor_shift;
+
+int jsl_index_available(void)
+{
+    return jsl_index_classify != NULL;
+}
+
+static void jsl_index_build(jsl_INDEX *ix)
+{
+    const uint8_t *buf = (const uint8_t *)ix->buf;
+    uint64_t prev_escaped = 0, prev_in_string = 0, prev_scalar = 0;
+    uint8_t tail[64];
+    size_t pos;
+
+    for (pos = 0; pos < ix->len; pos += 64) {
+        const uint8_t *ptr = buf + pos;
+        jsl_BLOCK blk;
+        uint64_t escaped, quote, in_string, scalar, structural, bad_ctrl, bad_escape;
+
+        if (ix->len - pos < 64) {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, ptr, ix->len - pos);
+            ptr = tail;
+        }
+        jsl_index_classify(ptr, &blk);
+
+        escaped = 0;
+        if (blk.bs | prev_escaped) {
+            escaped = jsl_index_find_escaped(blk.bs, &prev_escaped);
+        }
+        quote = blk.quote & ~escaped;
+        in_string = jsl_index_prefix_xor(quote) ^ prev_in_string;
+        prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+        /* the lexer reports whichever comes first, and an escaped control character as a bad escape */
+        bad_ctrl = blk.ctrl & in_string & ~escaped;
+        bad_escape = 0;
+        escaped &= in_string;
+        while (escaped) {
+            /* an escape at the very end of the input lands on the padding of tail */
+            switch (ptr[__builtin_ctzll(escaped)]) {
+                case '"':
+                case '\\':
+                case '/':
+                case 'b':
+                case 'f':
+                case 'n':
+                case 'r':
+                case 't':
+                case 'u':
+                    break;
+                default:
+                    bad_escape |= escaped & -escaped;
+                    break;
+            }
+            escaped &= escaped - 1;
+        }
+        if (bad_ctrl | bad_escape) {
+            uint64_t first = (bad_ctrl | bad_escape) & -(bad_ctrl | bad_escape);
+            jsl_index_fail(ix, (first & bad_escape) ? JSONSL_ERROR_ESCAPE_INVALID : JSONSL_ERROR_WEIRD_WHITESPACE,
+                           pos + __builtin_ctzll(first));
+            return;
+        }
+
+        scalar = ~(blk.op | blk.ws | quote) & ~in_string;
+        structural = (blk.op & ~in_string) | quote | (scalar & ~(scalar << 1 | prev_scalar));
+        prev_scalar = scalar >> 63;
+        if (ix->len - pos < 64) {
+            structural &= (1ULL << (ix->len - pos)) - 1;
+        }
+        while (structural) {
+            ix->idx[ix->nidx++] = (uint32_t)(pos + __builtin_ctzll(structural));
+            structural &= structural - 1;
+        }
+    }
+    if (prev_in_string) {
+        /* a backslash as the last byte of a block, as if it was in the middle of one */
+        jsl_index_fail(ix, prev_escaped ? JSONSL_ERROR_ESCAPE_INVALID : JSONSL_ERROR_STRING_OUTSIDE_CONTAINER,
+                       ix->len);
+    }
+}
+
+#else
+
+int jsl_index_available(void)
+{
+    return 0;
+}
+
+static void jsl_index_build(jsl_INDEX *ix)
+{
+    (void)ix;
+}
+
+#endif /* JSL_INDEX_SIMD */
+
+static void *jsl_index_build_nogvl(void *arg)
+{
+    jsl_index_build(arg);
+    return NULL;
+}
+
+static int jsl_index_is_delimiter(const jsl_INDEX *ix, size_t pos)
+{
+    if (pos >= ix->len) {
+        return 1;
+    }
+    switch (ix->buf[pos]) {
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+        case ',':
+        case ':':
+        case '[':
+        case ']':
+        case '{':
+        case '}':
+        case '"':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Appends the digits to *value, which wraps around after 19 digits */
+static int jsl_index_digits(const jsl_INDEX *ix, size_t *pos, uint64_t *value)
+{
+    size_t begin = *pos;
+    uint64_t acc = *value;
+    unsigned digit;
+
+    while (*pos < ix->len && (digit = (unsigned)(ix->buf[*pos] - '0')) < 10) {
+        acc = acc * 10 + digit;
+        (*pos)++;
+    }
+    *value = acc;
+    return *pos > begin;
+}
+
+static VALUE jsl_index_scalar(jsl_INDEX *ix, size_t begin)
+{
+    const char *ptr = ix->buf + begin;
+    size_t pos = begin;
+    unsigned flags = 0;
+    uint64_t value = 0, tmp = 0;
+    unsigned nfrac = 0;
+
+    switch (*ptr) {
+        case 't':
+            flags = JSONSL_SPECIALf_TRUE;
+            pos += (ix->len - begin >= 4 && memcmp(ptr, "true", 4) == 0) ? 4 : 0;
+            break;
+        case 'f':
+            flags = JSONSL_SPECIALf_FALSE;
+            pos += (ix->len - begin >= 5 && memcmp(ptr, "false", 5) == 0) ? 5 : 0;
+            break;
+        case 'n':
+            flags = JSONSL_SPECIALf_NULL;
+            pos += (ix->len - begin >= 4 && memcmp(ptr, "null", 4) == 0) ? 4 : 0;
+            break;
+        default:
+            flags = JSONSL_SPECIALf_UNSIGNED;
+            if (*ptr == '-') {
+                flags = JSONSL_SPECIALf_SIGNED;
+                pos++;
+            }
+            if (pos < ix->len && ix->buf[pos] == '0') {
+                pos++;
+            } else if (!jsl_index_digits(ix, &pos, &value)) {
+                jsl_index_fail(ix, begin == pos ? JSONSL_ERROR_SPECIAL_EXPECTED : JSONSL_ERROR_INVALID_NUMBER, pos);
+                return Qnil;
+            }
+            if (pos < ix->len && ix->buf[pos] == '.') {
+                size_t frac = ++pos;
+                flags |= JSONSL_SPECIALf_FLOAT;
+                if (!jsl_index_digits(ix, &pos, &value)) {
+                    jsl_index_fail(ix, JSONSL_ERROR_INVALID_NUMBER, pos);
+                    return Qnil;
+                }
+                nfrac = (unsigned)(pos - frac);
+            }
+            if (pos < ix->len && (ix->buf[pos] == 'e' || ix->buf[pos] == 'E')) {
+                pos++;
+                flags |= JSONSL_SPECIALf_EXPONENT;
+                if (pos < ix->len && (ix->buf[pos] == '-' || ix->buf[pos] == '+')) {
+                    pos++;
+                }
+                if (!jsl_index_digits(ix, &pos, &tmp)) {
+                    jsl_index_fail(ix, JSONSL_ERROR_INVALID_NUMBER, pos);
+                    return Qnil;
+                }
+            }
+            if (!jsl_index_is_delimiter(ix, pos)) {
+                jsl_index_fail(ix, JSONSL_ERROR_INVALID_NUMBER, pos);
+                return Qnil;
+            }
+            return jsl_value_special(ptr, pos - begin, flags, value, nfrac);
+    }
+    if (pos == begin || !jsl_index_is_delimiter(ix, pos)) {
+        jsl_index_fail(ix, JSONSL_ERROR_SPECIAL_EXPECTED, pos);
+        return Qnil;
+    }
+    return jsl_value_special(ptr, pos - begin, flags, value, nfrac);
+}
+
+/* Returns the offset of the next structural character, or the end of input */
+static size_t jsl_index_peek(const jsl_INDEX *ix)
+{
+    return ix->cur < ix->nidx ? ix->idx[ix->cur] : ix->len;
+}
+
+static char jsl_index_next(jsl_INDEX *ix, size_t *pos)
+{
+    *pos = jsl_index_peek(ix);
+    if (ix->cur >= ix->nidx) {
+        return '\0';
+    }
+    ix->cur++;
+    return ix->buf[*pos];
+}
+
+/* nkey is the position of a hash key in its object, or -1 for values */
+static VALUE jsl_index_string(jsl_INDEX *ix, size_t begin, long nkey)
+{
+    const char *ptr = ix->buf + begin + 1;
+    size_t end, len;
+    int escaped;
+    VALUE key;
+
+    if (jsl_index_next(ix, &end) != '"') {
+        jsl_index_fail(ix, JSONSL_ERROR_STRING_OUTSIDE_CONTAINER, end);
+        return Qnil;
+    }
+    len = end - begin - 1;
+    if (nkey >= 0) {
+        key = jsl_shapes_lookup(ix->shapes, ix->depth, (size_t)nkey, ptr, len);
+        if (key == Qundef) {
+            escaped = memchr(ptr, '\\', len) != NULL;
+            key = jsl_value_key(ptr, len, escaped, 0, ix->symbolize_names);
+            jsl_shapes_store(ix->shapes, ix->depth, (size_t)nkey, ptr, len, key);
+        }
+        return key;
+    }
+    escaped = memchr(ptr, '\\', len) != NULL;
+    if (ix->freeze) {
+        return jsl_value_key(ptr, len, escaped, 0, 0);
+    }
+    return jsl_value_string(ptr, len, escaped, 0);
+}
+
+static VALUE jsl_index_value(jsl_INDEX *ix);
+
+/*
+ * The lexer reports a missing key only when the byte could start some other
+ * token, anything else is classified the way it is at the start of a value.
+ */
+static jsonsl_error_t jsl_index_key_error(const jsl_INDEX *ix, char tok, size_t pos)
+{
+    if (pos >= ix->len) {
+        return JSONSL_ERROR_HKEY_EXPECTED;
+    }
+    if (tok == '\0') {
+        return JSONSL_ERROR_FOUND_NULL_BYTE;
+    }
+    if ((unsigned char)tok < 0x20) {
+        return JSONSL_ERROR_WEIRD_WHITESPACE;
+    }
+    if (strchr("{}[],:-0123456789INfint", tok)) {
+        return JSONSL_ERROR_HKEY_EXPECTED;
+    }
+    return JSONSL_ERROR_SPECIAL_EXPECTED;
+}
+
+static VALUE jsl_index_object(jsl_INDEX *ix)
+{
+    jsl_SIZE_HINT *hint = ix->depth < JSL_INDEX_PREDICT_DEPTH ? &ix->hints[ix->depth] : NULL;
+    VALUE hash;
+    size_t pos;
+    long nkey = 0;
+    char tok;
+
+    if (ix->cur < ix->nidx && ix->buf[jsl_index_peek(ix)] == '}') {
+        ix->cur++;
+        return rb_hash_new();
+    }
+    hash = hint && hint->object ? rb_hash_new_capa(hint->object) : rb_hash_new();
+    for (;;) {
+        VALUE key, val;
+
+        tok = jsl_index_next(ix, &pos);
+        if (tok != '"') {
+            jsl_index_fail(ix, jsl_index_key_error(ix, tok, pos), pos);
+            return Qnil;
+        }
+        key = jsl_index_string(ix, pos, nkey++);
+        if (ix->err) {
+            return Qnil;
+        }
+        if (jsl_index_next(ix, &pos) != ':') {
+            jsl_index_fail(ix, JSONSL_ERROR_MISSING_TOKEN, pos);
+            return Qnil;
+        }
+        val = jsl_index_value(ix);
+        if (ix->err) {
+            return Qnil;
+        }
+        rb_hash_aset(hash, key, val);
+        tok = jsl_index_next(ix, &pos);
+        if (tok == '}') {
+            if (hint) {
+                jsl_index_hint(&hint->object, (long)RHASH_SIZE(hash));
+            }
+            return hash;
+        } else if (tok != ',') {
+            jsl_index_fail(ix, tok == ']' ? JSONSL_ERROR_BRACKET_MISMATCH : JSONSL_ERROR_STRAY_TOKEN, pos);
+            return Qnil;
+        }
+    }
+}
+
+static VALUE jsl_index_list(jsl_INDEX *ix)
+{
+    jsl_SIZE_HINT *hint = ix->depth < JSL_INDEX_PREDICT_DEPTH ? &ix->hints[ix->depth] : NULL;
+    VALUE ary;
+    size_t pos;
+    char tok;
+
+    if (ix->cur < ix->nidx && ix->buf[jsl_index_peek(ix)] == ']') {
+        ix->cur++;
+        return rb_ary_new();
+    }
+    ary = hint && hint->list ? rb_ary_new_capa(hint->list) : rb_ary_new();
+    for (;;) {
+        VALUE val = jsl_index_value(ix);
+        if (ix->err) {
+            return Qnil;
+        }
+        rb_ary_push(ary, val);
+        tok = jsl_index_next(ix, &pos);
+        if (tok == ']') {
+            if (hint) {
+                jsl_index_hint(&hint->list, RARRAY_LEN(ary));
+            }
+            return ary;
+        } else if (tok != ',') {
+            jsl_index_fail(ix, tok == '}' ? JSONSL_ERROR_BRACKET_MISMATCH : JSONSL_ERROR_STRAY_TOKEN, pos);
+            return Qnil;
+        }
+    }
+}
+
+static VALUE jsl_index_value(jsl_INDEX *ix)
+{
+    VALUE val;
+    size_t pos;
+    char tok = jsl_index_next(ix, &pos);
+
+    if (++ix->depth >= ix->max_depth) {
+        jsl_index_fail(ix, JSONSL_ERROR_LEVELS_EXCEEDED, pos);
+        return Qnil;
+    }
+    switch (tok) {
+        case '{':
+            val = jsl_index_object(ix);
+            break;
+        case '[':
+            val = jsl_index_list(ix);
+            break;
+        case '"':
+            val = jsl_index_string(ix, pos, -1);
+            break;
+        case '\0':
+            /* the end of the index, unless there is a NUL byte in the input */
+            jsl_index_fail(ix, pos < ix->len ? JSONSL_ERROR_FOUND_NULL_BYTE : JSONSL_ERROR_VALUE_EXPECTED, pos);
+            return Qnil;
+        case ']':
+        case '}':
+        case ',':
+        case ':':
+            jsl_index_fail(ix, JSONSL_ERROR_STRAY_TOKEN, pos);
+            return Qnil;
+        default:
+            if ((unsigned char)tok < 0x20) {
+                /* the lexer checks the first byte of a value the same way */
+                jsl_index_fail(ix, JSONSL_ERROR_WEIRD_WHITESPACE, pos);
+                return Qnil;
+            }
+            val = jsl_index_scalar(ix, pos);
+            break;
+    }
+    if (ix->freeze && (tok == '{' || tok == '[') && ix->err == JSONSL_ERROR_SUCCESS) {
+        jsl_value_freeze(val);
+    }
+    ix->depth--;
+    return val;
+}
+
+/*
+ * The caller keeps buf alive, it is either a frozen String or a file mapping:
+ * large inputs are indexed without the GVL.
+ */
+VALUE jsl_index_parse(const char *buf, size_t len, int nlevels, const jsl_OPTIONS *options)
+{
+    jsl_INDEX ix = {0};
+    jsl_SHAPES shapes;
+    VALUE idx, res = Qnil;
+
+    ix.buf = buf;
+    ix.len = len;
+    ix.max_depth = jsl_index_max_depth(nlevels);
+    ix.symbolize_names = options->symbolize_names;
+    ix.freeze = options->freeze;
+    ix.shapes = &shapes;
+    jsl_shapes_reset(&shapes);
+    idx = rb_str_tmp_new((ix.len + 1) * sizeof(uint32_t));
+    ix.idx = (uint32_t *)RSTRING_PTR(idx);
+
+    if (ix.len >= options->nogvl_min) {
+        rb_thread_call_without_gvl(jsl_index_build_nogvl, &ix, NULL, NULL);
+    } else {
+        jsl_index_build(&ix);
+    }
+    if (ix.err == JSONSL_ERROR_SUCCESS && ix.nidx > 0) {
+        size_t root = ix.idx[0];
+        if (ix.buf[root] == '"') {
+            jsl_index_fail(&ix, JSONSL_ERROR_STRING_OUTSIDE_CONTAINER, root);
+        } else {
+            res = jsl_index_value(&ix);
+            if (ix.err == JSONSL_ERROR_SUCCESS && ix.cur < ix.nidx) {
+                jsl_index_fail(&ix, JSONSL_ERROR_GARBAGE_TRAILING, ix.idx[ix.cur]);
+            }
+        }
+    }
+    if (ix.err != JSONSL_ERROR_SUCCESS) {
+        char buf[30] = {0};
+        sprintf(buf, "error at %d position", (int)ix.errpos);
+        jsl_raise(ix.err, buf);
+    }
+    RB_GC_GUARD(idx);
+    return res;
+}
+
+/* Smaller inputs are not worth starting a thread for */
+#define JSL_LINES_MIN_CHUNK 65536
+#define JSL_LINES_MAX_THREADS 64
+
+typedef struct jsl_CHUNK {
+    jsl_INDEX ix;
+    size_t offset;
+#ifdef JSL_INDEX_THREADS
+    pthread_t thread;
+    int started;
+#endif
+} jsl_CHUNK;
+
+typedef struct jsl_LINES {
+    jsl_CHUNK *chunks;
+    size_t nchunks;
+} jsl_LINES;
+
+#ifdef JSL_INDEX_THREADS
+static void *jsl_lines_build_chunk(void *arg)
+{
+    jsl_index_build(&((jsl_CHUNK *)arg)->ix);
+    return NULL;
+}
+#endif
+
+/* Called without the GVL, the first chunk is indexed by the calling thread */
+static void *jsl_lines_build(void *arg)
+{
+    jsl_LINES *lines = arg;
+    size_t ii;
+
+#ifdef JSL_INDEX_THREADS
+    for (ii = 1; ii < lines->nchunks; ii++) {
+        jsl_CHUNK *chunk = &lines->chunks[ii];
+        chunk->started = pthread_create(&chunk->thread, NULL, jsl_lines_build_chunk, chunk) == 0;
+    }
+    jsl_index_build(&lines->chunks[0].ix);
+    for (ii = 1; ii < lines->nchunks; ii++) {
+        jsl_CHUNK *chunk = &lines->chunks[ii];
+        if (chunk->started) {
+            pthread_join(chunk->thread, NULL);
+        } else {
+            jsl_index_build(&chunk->ix);
+        }
+    }
+#else
+    for (ii = 0; ii < lines->nchunks; ii++) {
+        jsl_index_build(&lines->chunks[ii].ix);
+    }
+#endif
+    return NULL;
+}
+
+/*
+ * Every value has to be on its own line, otherwise the result would depend
+ * on where the input has been cut.
+ */
+static void jsl_lines_values(jsl_INDEX *ix, VALUE res)
+{
+    size_t begin, end, prev = 0;
+    const char *nl;
+    VALUE val;
+
+    while (ix->cur < ix->nidx) {
+        begin = ix->idx[ix->cur];
+        if (ix->cur > 0 && memchr(ix->buf + prev, '\n', begin - prev) == NULL) {
+            jsl_index_fail(ix, JSONSL_ERROR_GARBAGE_TRAILING, begin);
+            return;
+        }
+        val = jsl_index_value(ix);
+        if (ix->err) {
+            return;
+        }
+        /* for scalars this is their first character */
+        end = ix->idx[ix->cur - 1];
+        nl = memchr(ix->buf + begin, '\n', end - begin);
+        if (nl) {
+            jsl_index_fail(ix, JSONSL_ERROR_WEIRD_WHITESPACE, nl - ix->buf);
+            return;
+        }
+        rb_ary_push(res, val);
+        prev = end;
+    }
+}
+
+static VALUE jsl_lines_push(RB_BLOCK_CALL_FUNC_ARGLIST(val, res))
+{
+    return rb_ary_push(res, val);
+}
+
+/*
+ * Without the index (or with mode: :lexer) the values are read by
+ * JSONSL::StreamParser, which checks the lines just as strictly.
+ */
+static VALUE jsl_lines_fallback(VALUE str, VALUE nlevels, const jsl_OPTIONS *options)
+{
+    VALUE res = rb_ary_new(), opts = rb_hash_new(), parser, args[2];
+    int argc = 0;
+
+    if (nlevels != Qnil) {
+        args[argc++] = nlevels;
+    }
+    rb_hash_aset(opts, jsl_sym_symbolize_names, options->symbolize_names ? Qtrue : Qfalse);
+    rb_hash_aset(opts, jsl_sym_freeze, options->freeze ? Qtrue : Qfalse);
+    rb_hash_aset(opts, jsl_sym_lines, Qtrue);
+    args[argc++] = opts;
+    parser = rb_block_call_kw(jsl_cStreamParser, rb_intern("new"), argc, args, jsl_lines_push, res, RB_PASS_KEYWORDS);
+    rb_funcall(parser, rb_intern("feed"), 1, str);
+    rb_funcall(parser, rb_intern("finish"), 0);
+    return res;
+}
+
+/* str has to be frozen, the workers read it while other threads run */
+static VALUE jsl_lines_parse(VALUE str, VALUE nlevels, long nthreads, const jsl_OPTIONS *options)
+{
+    const char *buf = RSTRING_PTR(str);
+    size_t len = (size_t)RSTRING_LEN(str), target, begin, end, ii;
+    jsl_LINES lines;
+    jsl_SHAPES shapes;
+    VALUE chunks, idx, res;
+
+    if (nthreads > JSL_LINES_MAX_THREADS) {
+        nthreads = JSL_LINES_MAX_THREADS;
+    }
+    if ((size_t)nthreads > len / JSL_LINES_MIN_CHUNK) {
+        nthreads = len < 2 * JSL_LINES_MIN_CHUNK ? 1 : (long)(len / JSL_LINES_MIN_CHUNK);
+    }
+    target = len / (size_t)nthreads;
+    chunks = rb_str_tmp_new(nthreads * sizeof(jsl_CHUNK));
+    lines.chunks = (jsl_CHUNK *)RSTRING_PTR(chunks);
+    lines.nchunks = 0;
+    memset(lines.chunks, 0, nthreads * sizeof(jsl_CHUNK));
+    idx = rb_str_tmp_new((len + nthreads) * sizeof(uint32_t));
+    jsl_shapes_reset(&shapes);
+
+    for (begin = 0; begin < len; begin = end) {
+        jsl_CHUNK *chunk = &lines.chunks[lines.nchunks];
+        end = len;
+        if (lines.nchunks + 1 < (size_t)nthreads && len - begin > target) {
+            const char *nl = memchr(buf + begin + target, '\n', len - begin - target);
+            if (nl) {
+                end = nl - buf + 1;
+            }
+        }
+        if (end - begin >= UINT32_MAX) {
+            return jsl_lines_fallback(str, nlevels, options);
+        }
+        chunk->offset = begin;
+        chunk->ix.buf = buf + begin;
+        chunk->ix.len = end - begin;
+        chunk->ix.idx = (uint32_t *)RSTRING_PTR(idx) + begin + lines.nchunks;
+        chunk->ix.max_depth = jsl_index_max_depth(nlevels == Qnil ? JSONSL_MAX_LEVELS : FIX2INT(nlevels));
+        chunk->ix.symbolize_names = options->symbolize_names;
+        chunk->ix.freeze = options->freeze;
+        chunk->ix.shapes = &shapes;
+        lines.nchunks++;
+    }
+    if (lines.nchunks > 0) {
+        rb_thread_call_without_gvl(jsl_lines_build, &lines, NULL, NULL);
+    }
+
+    res = rb_ary_new();
+    for (ii = 0; ii < lines.nchunks; ii++) {
+        jsl_CHUNK *chunk = &lines.chunks[ii];
+        if (ii > 0) {
+            memcpy(chunk->ix.hints, lines.chunks[ii - 1].ix.hints, sizeof(chunk->ix.hints));
+        }
+        if (chunk->ix.err == JSONSL_ERROR_SUCCESS) {
+            jsl_lines_values(&chunk->ix, res);
+        }
+        if (chunk->ix.err != JSONSL_ERROR_SUCCESS) {
+            char msg[40] = {0};
+            snprintf(msg, sizeof(msg), "error at %lu position", (unsigned long)(chunk->offset + chunk->ix.errpos));
+            jsl_raise(chunk->ix.err, msg);
+        }
+    }
+    RB_GC_GUARD(str);
+    RB_GC_GUARD(chunks);
+    RB_GC_GUARD(idx);
+    return options->freeze ? jsl_value_freeze(res) : res;
+}
+
+/*
+ * Parses newline-delimited JSON, one value per line, and returns the values
+ * in an array. The input is indexed by up to threads: native threads, unless
+ * mode: :lexer asks for the streaming lexer.
+ */
+static VALUE jsl_jsonsl_parse_lines(int argc, VALUE *argv, VALUE self)
+{
+    jsl_OPTIONS options;
+    VALUE str = Qnil, nlevels = Qnil, opts = Qnil, threads = Qnil;
+    long nthreads = 1;
+
+    rb_scan_args(argc, argv, "11:", &str, &nlevels, &opts);
+    Check_Type(str, T_STRING);
+    if (nlevels != Qnil) {
+        Check_Type(nlevels, T_FIXNUM);
+    }
+    jsl_parse_opts(opts, &options);
+    if (opts != Qnil) {
+        threads = rb_hash_aref(opts, jsl_sym_threads);
+    }
+    if (threads != Qnil) {
+        nthreads = NUM2LONG(threads);
+        if (nthreads <= 0) {
+            rb_raise(rb_eArgError, "number of threads must be positive");
+        }
+    }
+    (void)self;
+    if (!jsl_index_available() || options.mode == jsl_sym_lexer) {
+        return jsl_lines_fallback(str, nlevels, &options);
+    }
+    return jsl_lines_parse(rb_str_new_frozen(str), nlevels, nthreads, &options);
+}
+
+void jsl_index_init()
+{
+    jsl_sym_threads = ID2SYM(rb_intern("threads"));
+    rb_define_singleton_method(jsl_mJSONSL, "parse_lines", jsl_jsonsl_parse_lines, -1);
+#ifdef JSL_INDEX_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        jsl_index_classify = jsl_index_classify_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        jsl_index_classify = jsl_index_classify_sse2;
+    }
+    if (__builtin_cpu_supports("pclmul")) {
+        jsl_index_prefix_xor = jsl_index_prefix_xor_clmul;
+    }
+#endif /* JSL_INDEX_SIMD */
+}
@@ -0,0 +1,165 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Author:: Couchbase <info@couchbase.com>
+ * Copyright:: 2018 Couchbase, Inc.
+ * License:: Apache License, Version 2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "jsonsl_ext.h"
+
+VALUE jsl_cParser;
+
+typedef struct jsl_TREE_PARSER {
+    jsonsl_t jsn;
+    jsl_VALUES values;
+    int busy;
+} jsl_TREE_PARSER;
+
+static void jsl_tree_mark(void *ptr)
+{
+    jsl_TREE_PARSER *parser = ptr;
+    if (parser) {
+        jsl_values_mark(&parser->values);
+    }
+}
+
+static void jsl_tree_free(void *ptr)
+{
+    jsl_TREE_PARSER *parser = ptr;
+    if (parser) {
+        if (parser->jsn) {
+            jsonsl_destroy(parser->jsn);
+        }
+        parser->jsn = NULL;
+        jsl_values_free(&parser->values);
+        ruby_xfree(parser);
+    }
+}
+
+static VALUE jsl_tree_alloc(VALUE klass)
+{
+    VALUE obj;
+    jsl_TREE_PARSER *parser;
+
+    obj = Data_Make_Struct(klass, jsl_TREE_PARSER, jsl_tree_mark, jsl_tree_free, parser);
+    return obj;
+}
+
+static jsl_TREE_PARSER *jsl_tree_get(VALUE self)
+{
+    jsl_TREE_PARSER *parser = DATA_PTR(self);
+
+    if (parser->jsn == NULL) {
+        rb_raise(rb_eRuntimeError, "parser is not initialized");
+    }
+    if (parser->busy) {
+        rb_raise(rb_eRuntimeError, "parser is already in use");
+    }
+    return parser;
+}
+
+static VALUE jsl_tree_init(int argc, VALUE *argv, VALUE self)
+{
+    jsl_TREE_PARSER *parser = DATA_PTR(self);
+    VALUE nlevels = Qnil;
+    jsonsl_t jsn;
+
+    rb_scan_args(argc, argv, "01", &nlevels);
+    jsn = jsl_lexer_new(nlevels);
+    if (parser->jsn) {
+        jsonsl_destroy(parser->jsn);
+    }
+    parser->jsn = jsn;
+    jsl_lexer_setup(parser->jsn);
+    return self;
+}
+
+struct jsl_tree_parse_args {
+    jsl_TREE_PARSER *parser;
+    VALUE str;
+    jsl_OPTIONS options;
+};
+
+static VALUE jsl_tree_parse_body(VALUE arg)
+{
+    struct jsl_tree_parse_args *args = (struct jsl_tree_parse_args *)arg;
+    return jsl_lexer_parse(args->parser->jsn, args->str, &args->options, &args->parser->values);
+}
+
+static VALUE jsl_tree_parse_ensure(VALUE arg)
+{
+    struct jsl_tree_parse_args *args = (struct jsl_tree_parse_args *)arg;
+    args->parser->jsn->data = NULL;
+    args->parser->values.len = 0;
+    args->parser->busy = 0;
+    return Qnil;
+}
+
+static VALUE jsl_tree_parse(int argc, VALUE *argv, VALUE self)
+{
+    struct jsl_tree_parse_args args;
+    VALUE str = Qnil, opts = Qnil;
+
+    args.parser = jsl_tree_get(self);
+    rb_scan_args(argc, argv, "1:", &str, &opts);
+    Check_Type(str, T_STRING);
+    jsl_parse_opts(opts, &args.options);
+    /* other threads may change str while the GVL is released */
+    str = rb_str_new_frozen(str);
+    if (jsl_index_wanted(RSTRING_LEN(str), &args.options)) {
+        VALUE res = jsl_index_parse(RSTRING_PTR(str), RSTRING_LEN(str), (int)args.parser->jsn->levels_max,
+                                    &args.options);
+        RB_GC_GUARD(str);
+        return res;
+    }
+    args.str = str;
+    args.parser->busy = 1;
+    return rb_ensure(jsl_tree_parse_body, (VALUE)&args, jsl_tree_parse_ensure, (VALUE)&args);
+}
+
+static VALUE jsl_tree_reset(VALUE self)
+{
+    jsl_TREE_PARSER *parser = jsl_tree_get(self);
+
+    jsonsl_reset(parser->jsn);
+    parser->jsn->data = NULL;
+    return self;
+}
+
+static VALUE jsl_tree_inspect(VALUE self)
+{
+    jsl_TREE_PARSER *parser = DATA_PTR(self);
+    VALUE str;
+
+    str = rb_str_buf_new2("#<");
+    rb_str_buf_cat2(str, rb_obj_classname(self));
+    rb_str_catf(str, ":%p", (void *)self);
+    if (parser->jsn) {
+        rb_str_catf(str, " max_levels=%u", parser->jsn->levels_max);
+    }
+    rb_str_buf_cat_ascii(str, ">");
+
+    return str;
+}
+
+void jsl_tree_parser_init()
+{
+    jsl_cParser = rb_define_class_under(jsl_mJSONSL, "Parser", rb_cObject);
+    rb_define_alloc_func(jsl_cParser, jsl_tree_alloc);
+    rb_define_method(jsl_cParser, "initialize", jsl_tree_init, -1);
+    rb_define_method(jsl_cParser, "inspect", jsl_tree_inspect, 0);
+    rb_define_method(jsl_cParser, "parse", jsl_tree_parse, -1);
+    rb_define_method(jsl_cParser, "reset", jsl_tree_reset, 0);
+}
@@ -22,8 +22,7 @@
 VALUE jsl_cRowParser;
 
 ID jsl_id_call;
-ID jsl_sym_root;
-ID jsl_sym_rows;
+static VALUE jsl_sym_stats;
 
 typedef struct jsl_PARSER {
     jsonsl_t jsn;
@@ -32,11 +31,33 @@ typedef struct jsl_PARSER {
     VALUE proc;
     VALUE last_key;
     int initialized;
+    /* nesting level of the list of rows, the root object is at level 1 */
+    unsigned int rows_level;
     size_t last_row_endpos;
     size_t header_len;
+    /* bytes after the header which are gone from the buffer, see jsl_parser_compact() */
+    size_t dropped;
     int rowcount;
 } jsl_PARSER;
 
+/* Lexer positions count from the start of the input, the buffer skips dropped bytes */
+static const char *jsl_parser_at(const jsl_PARSER *parser, size_t pos)
+{
+    return RSTRING_PTR(parser->buffer) + (pos < parser->header_len ? pos : pos - parser->dropped);
+}
+
+/* Rows are slices of the raw input, so they are checked like parsed strings */
+static VALUE jsl_parser_checked(VALUE str)
+{
+    int nonascii = jsl_utf8_scan(RSTRING_PTR(str), RSTRING_LEN(str));
+
+    if (nonascii < 0) {
+        jsl_raise(JSONSL_ERROR_INVALID_CODEPOINT, "invalid UTF-8 in row");
+    }
+    ENC_CODERANGE_SET(str, nonascii ? ENC_CODERANGE_VALID : ENC_CODERANGE_7BIT);
+    return str;
+}
+
 static void jsl_parser_mark(void *ptr)
 {
     jsl_PARSER *parser = ptr;
@@ -106,13 +127,13 @@ static void jsl_parser_cover_pop_callback(jsonsl_t jsn, jsonsl_action_t action,
     jsl_PARSER *parser = (jsl_PARSER *)jsn->data;
     VALUE cover;
 
-    if (state->val != jsl_sym_root) {
+    if (state->level != 1) {
         return;
     }
-    cover = rb_str_new(RSTRING_PTR(parser->buffer), parser->header_len);
-    rb_str_cat(cover, RSTRING_PTR(parser->buffer) + parser->last_row_endpos,
-               RSTRING_LEN(parser->buffer) - parser->last_row_endpos);
-    rb_funcall(parser->proc, jsl_id_call, 1, cover);
+    cover = rb_utf8_str_new(RSTRING_PTR(parser->buffer), parser->header_len);
+    rb_str_cat(cover, jsl_parser_at(parser, parser->last_row_endpos),
+               RSTRING_END(parser->buffer) - jsl_parser_at(parser, parser->last_row_endpos));
+    rb_funcall(parser->proc, jsl_id_call, 1, jsl_parser_checked(cover));
     jsl_parser_reset(parser);
     (void)action;
     (void)at;
@@ -124,7 +145,7 @@ static void jsl_parser_row_pop_callback(jsonsl_t jsn, jsonsl_action_t action, st
     jsl_PARSER *parser = (jsl_PARSER *)jsn->data;
     parser->last_row_endpos = jsn->pos;
 
-    if (state->val == jsl_sym_rows) {
+    if (state->level == parser->rows_level) {
         jsn->action_callback_POP = jsl_parser_cover_pop_callback;
         jsn->action_callback_PUSH = NULL;
         if (parser->rowcount == 0) {
@@ -133,12 +154,13 @@ static void jsl_parser_row_pop_callback(jsonsl_t jsn, jsonsl_action_t action, st
         return;
     }
 
-    const char *ptr = RSTRING_PTR(parser->buffer) + state->pos_begin;
+    const char *ptr = jsl_parser_at(parser, state->pos_begin);
     size_t len = jsn->pos - state->pos_begin + 1;
     if (state->type == JSONSL_T_SPECIAL) {
         len--;
     }
-    rb_funcall(parser->proc, jsl_id_call, 2, rb_str_new(ptr, len), INT2FIX(parser->rowcount));
+    rb_funcall(parser->proc, jsl_id_call, 2, jsl_parser_checked(rb_utf8_str_new(ptr, len)),
+               INT2FIX(parser->rowcount));
     parser->rowcount++;
 
     (void)action;
@@ -160,12 +182,11 @@ static void jsl_parser_initial_push_callback(jsonsl_t jsn, jsonsl_action_t actio
         if (match != JSONSL_MATCH_POSSIBLE) {
             jsl_raise_msg("root does not match JSON pointer");
         }
-        state->val = jsl_sym_root;
         parser->initialized = 1;
     }
 
     if (state->type == JSONSL_T_LIST && match == JSONSL_MATCH_POSSIBLE) {
-        state->val = jsl_sym_rows;
+        parser->rows_level = state->level;
         jsn->action_callback_POP = jsl_parser_row_pop_callback;
         jsn->action_callback_PUSH = jsl_parser_cover_push_callback;
     }
@@ -192,9 +213,10 @@ static VALUE jsl_parser_init(int argc, VALUE *argv, VALUE self)
     VALUE nlevels = Qnil;
     VALUE jptr = Qnil;
     VALUE proc = Qnil;
+    VALUE opts = Qnil;
     jsonsl_error_t rc = JSONSL_ERROR_SUCCESS;
 
-    rb_scan_args(argc, argv, "11&", &jptr, &nlevels, &proc);
+    rb_scan_args(argc, argv, "11:&", &jptr, &nlevels, &opts, &proc);
     if (proc == Qnil) {
         rb_raise(rb_eArgError, "tried to create Parser object without a block");
     }
@@ -211,17 +233,23 @@ static VALUE jsl_parser_init(int argc, VALUE *argv, VALUE self)
         parser->jsn = jsonsl_new(JSONSL_MAX_LEVELS);
     }
     parser->initialized = 0;
+    parser->rows_level = 0;
+    parser->dropped = 0;
     parser->buffer = rb_str_buf_new(100);
     parser->last_key = rb_str_new_cstr("");
     parser->proc = proc;
     parser->jsn->data = parser;
     parser->jsn->max_callback_level = 4;
+    parser->jsn->options.skip_ignored = 1;
     jsonsl_jpr_match_state_init(parser->jsn, &parser->ptr, 1);
     jsonsl_reset(parser->jsn);
     parser->jsn->error_callback = jsl_parser_error_callback;
     parser->jsn->action_callback_PUSH = jsl_parser_initial_push_callback;
     parser->jsn->action_callback_POP = jsl_parser_initial_pop_callback;
     jsonsl_enable_all_callbacks(parser->jsn);
+    if (opts != Qnil && RTEST(rb_hash_aref(opts, jsl_sym_stats))) {
+        jsonsl_enable_metrics(parser->jsn, 1);
+    }
     return self;
 }
 
@@ -245,31 +273,175 @@ static VALUE jsl_parser_inspect(VALUE self)
     return str;
 }
 
+/*
+ * Once the header is known, only the row which is still open (or the tail
+ * of the cover, after the list of rows) has to be kept. The bytes between
+ * them and the header are dropped when they take at least half of the
+ * buffer, so the memory is bounded by the largest row rather than the whole
+ * response, and every byte is moved a constant number of times on average.
+ */
+static size_t jsl_parser_keep(jsl_PARSER *parser)
+{
+    jsonsl_t jsn = parser->jsn;
+    size_t begin = parser->header_len + parser->dropped;
+    size_t keep = begin;
+
+    if (parser->header_len == 0) {
+        return begin;
+    }
+    if (jsn->action_callback_POP == jsl_parser_row_pop_callback) {
+        keep = jsn->level > parser->rows_level ? jsn->stack[parser->rows_level + 1].pos_begin : jsn->pos;
+    } else if (jsn->action_callback_POP == jsl_parser_cover_pop_callback) {
+        keep = parser->last_row_endpos;
+    }
+    return keep < begin ? begin : keep;
+}
+
+static void jsl_parser_compact(jsl_PARSER *parser)
+{
+    size_t keep, begin, len;
+    char *ptr;
+
+    if (NIL_P(parser->buffer)) {
+        return;
+    }
+    keep = jsl_parser_keep(parser);
+    begin = parser->header_len + parser->dropped;
+    len = (size_t)RSTRING_LEN(parser->buffer);
+    if (keep == begin || keep - begin < len / 2) {
+        return;
+    }
+    ptr = RSTRING_PTR(parser->buffer);
+    memmove(ptr + parser->header_len, ptr + (keep - parser->dropped), len - (keep - parser->dropped));
+    rb_str_set_len(parser->buffer, (long)(len - (keep - begin)));
+    parser->dropped += keep - begin;
+}
+
 static VALUE jsl_parser_feed(VALUE self, VALUE data)
 {
     jsl_PARSER *parser = DATA_PTR(self);
+    VALUE buffer = parser->buffer;
     size_t old_len;
 
-    if (NIL_P(parser->buffer)) {
+    if (NIL_P(buffer)) {
         return self;
     }
     Check_Type(data, T_STRING);
-    old_len = RSTRING_LEN(parser->buffer);
-    rb_str_buf_append(parser->buffer, data);
-    jsonsl_feed(parser->jsn, RSTRING_PTR(parser->buffer) + old_len, RSTRING_LEN(data));
+    old_len = RSTRING_LEN(buffer);
+    rb_str_buf_append(buffer, data);
+    jsonsl_feed(parser->jsn, RSTRING_PTR(buffer) + old_len, RSTRING_LEN(data));
+    jsl_parser_compact(parser);
+    /* the cover callback releases the buffer while it is still being lexed */
+    RB_GC_GUARD(buffer);
+
+    return self;
+}
 
+/* Feeds the whole IO, reading it into one reused chunk buffer */
+static VALUE jsl_parser_consume(int argc, VALUE *argv, VALUE self)
+{
+    jsl_PARSER *parser = DATA_PTR(self);
+    VALUE io = Qnil, opts = Qnil, outbuf, chunk;
+    long chunk_size;
+
+    rb_scan_args(argc, argv, "1:", &io, &opts);
+    chunk_size = jsl_chunk_size(opts);
+    outbuf = rb_str_buf_new(chunk_size);
+    while (!NIL_P(parser->buffer) && (chunk = jsl_io_read(io, chunk_size, outbuf)) != Qnil) {
+        jsl_parser_feed(self, chunk);
+    }
+    RB_GC_GUARD(outbuf);
     return self;
 }
 
+struct jsl_parser_file_args {
+    jsl_PARSER *parser;
+    jsl_MAPPING map;
+    VALUE buffer;
+};
+
+static VALUE jsl_parser_consume_file_body(VALUE arg)
+{
+    struct jsl_parser_file_args *args = (struct jsl_parser_file_args *)arg;
+    jsl_PARSER *parser = args->parser;
+    size_t old_len = RSTRING_LEN(parser->buffer);
+
+    if (old_len == 0) {
+        /* rows and the cover are sliced straight from the mapping */
+        args->buffer = parser->buffer = rb_str_new_static(args->map.ptr, (long)args->map.len);
+    } else {
+        rb_str_cat(parser->buffer, args->map.ptr, (long)args->map.len);
+    }
+    jsonsl_feed(parser->jsn, RSTRING_PTR(parser->buffer) + old_len, args->map.len);
+    return Qnil;
+}
+
+static VALUE jsl_parser_consume_file_ensure(VALUE arg)
+{
+    struct jsl_parser_file_args *args = (struct jsl_parser_file_args *)arg;
+    jsl_PARSER *parser = args->parser;
+
+    if (args->buffer != Qnil && parser->buffer == args->buffer) {
+        /* not finished yet, later feeds need the header and the open tail only */
+        size_t keep = jsl_parser_keep(parser);
+        size_t tail = (size_t)RSTRING_LEN(args->buffer) - keep;
+
+        parser->buffer = rb_str_buf_new((long)(parser->header_len + tail));
+        rb_str_cat(parser->buffer, args->map.ptr, (long)parser->header_len);
+        rb_str_cat(parser->buffer, args->map.ptr + keep, (long)tail);
+        parser->dropped = keep - parser->header_len;
+    }
+    jsl_mapping_close(&args->map);
+    return Qnil;
+}
+
+/* Feeds the whole file, without copying it when nothing was fed before */
+static VALUE jsl_parser_consume_file(VALUE self, VALUE path)
+{
+    struct jsl_parser_file_args args;
+
+    args.parser = DATA_PTR(self);
+    args.buffer = Qnil;
+    if (NIL_P(args.parser->buffer)) {
+        return self;
+    }
+    jsl_mapping_open(&args.map, path);
+    if (args.map.len > 0) {
+        rb_ensure(jsl_parser_consume_file_body, (VALUE)&args, jsl_parser_consume_file_ensure, (VALUE)&args);
+    }
+    return self;
+}
+
+static VALUE jsl_parser_stats(VALUE self)
+{
+    jsl_PARSER *parser = DATA_PTR(self);
+
+    if (parser->jsn == NULL || parser->jsn->metrics == NULL) {
+        return Qnil;
+    }
+    return jsl_metrics_hash(parser->jsn->metrics, Qnil);
+}
+
+/* Bytes of the input which are still held, the header included */
+static VALUE jsl_parser_buffer_size(VALUE self)
+{
+    jsl_PARSER *parser = DATA_PTR(self);
+
+    return LONG2NUM(parser->buffer == Qnil ? 0 : RSTRING_LEN(parser->buffer));
+}
+
 void jsl_row_parser_init()
 {
     jsl_id_call = rb_intern("call");
-    jsl_sym_root = ID2SYM(rb_intern("root"));
-    jsl_sym_rows = ID2SYM(rb_intern("row"));
+    jsl_sym_stats = ID2SYM(rb_intern("stats"));
 
     jsl_cRowParser = rb_define_class_under(jsl_mJSONSL, "RowParser", rb_cObject);
     rb_define_alloc_func(jsl_cRowParser, jsl_parser_alloc);
     rb_define_method(jsl_cRowParser, "initialize", jsl_parser_init, -1);
     rb_define_method(jsl_cRowParser, "inspect", jsl_parser_inspect, 0);
     rb_define_method(jsl_cRowParser, "feed", jsl_parser_feed, 1);
+    rb_define_method(jsl_cRowParser, "consume", jsl_parser_consume, -1);
+    rb_define_method(jsl_cRowParser, "consume_file", jsl_parser_consume_file, 1);
+    rb_define_method(jsl_cRowParser, "stats", jsl_parser_stats, 0);
+    rb_define_method(jsl_cRowParser, "buffer_size", jsl_parser_buffer_size, 0);
 }
@@ -0,0 +1,440 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Author:: Couchbase <info@couchbase.com>
+ * Copyright:: 2018 Couchbase, Inc.
+ * License:: Apache License, Version 2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parser for streams of top-level values: newline-delimited JSON, RFC 7464
+ * JSON text sequences (values prefixed with the RS character) and plain
+ * concatenated JSON.
+ *
+ * Every value is lexed as the first element of a virtual list, so scalars
+ * are allowed at the top level too. Once it pops, the lexer is stopped, and
+ * reset before the next value. The buffer keeps the input from the start of
+ * the value which is still open.
+ *
+ * With lines: true the input is strict NDJSON, as in JSONSL.parse_lines:
+ * every value must start on a new line and must not span lines.
+ */
+
+#include "jsonsl_ext.h"
+
+VALUE jsl_cStreamParser;
+VALUE jsl_sym_lines;
+
+static VALUE jsl_sym_raw;
+static VALUE jsl_sym_batch;
+
+#define JSL_STREAM_IDLE 0
+#define JSL_STREAM_VALUE 1
+#define JSL_STREAM_FAILED 2
+
+typedef struct jsl_STREAM {
+    /* must stay the first member, the tree builder finds it in jsn->data */
+    jsl_CONTEXT ctx;
+    jsl_VALUES values;
+    jsonsl_t jsn;
+    jsonsl_stack_callback builder_pop;
+    VALUE proc;
+    VALUE buffer;
+    VALUE batch;
+    VALUE pending;
+    long batch_size;
+    int raw;
+    int lines;
+    int newline;
+    int state;
+    int done;
+    size_t fed;
+    size_t value_begin;
+    size_t value_end;
+    size_t offset;
+} jsl_STREAM;
+
+static void jsl_stream_mark(void *ptr)
+{
+    jsl_STREAM *stream = ptr;
+    if (stream) {
+        rb_gc_mark(stream->proc);
+        rb_gc_mark(stream->buffer);
+        rb_gc_mark(stream->batch);
+        rb_gc_mark(stream->pending);
+        jsl_values_mark(&stream->values);
+        jsl_shapes_mark(&stream->ctx.shapes);
+    }
+}
+
+static void jsl_stream_free(void *ptr)
+{
+    jsl_STREAM *stream = ptr;
+    if (stream) {
+        if (stream->jsn) {
+            jsonsl_destroy(stream->jsn);
+        }
+        stream->jsn = NULL;
+        jsl_values_free(&stream->values);
+        ruby_xfree(stream);
+    }
+}
+
+static VALUE jsl_stream_alloc(VALUE klass)
+{
+    VALUE obj;
+    jsl_STREAM *stream;
+
+    obj = Data_Make_Struct(klass, jsl_STREAM, jsl_stream_mark, jsl_stream_free, stream);
+    stream->proc = Qnil;
+    stream->buffer = Qnil;
+    stream->batch = Qnil;
+    stream->pending = Qnil;
+    stream->ctx.result = Qnil;
+    return obj;
+}
+
+static jsl_STREAM *jsl_stream_get(VALUE self)
+{
+    jsl_STREAM *stream = DATA_PTR(self);
+
+    if (stream->jsn == NULL) {
+        rb_raise(rb_eRuntimeError, "parser is not initialized");
+    }
+    return stream;
+}
+
+static int jsl_stream_error_callback(jsonsl_t jsn, jsonsl_error_t err, struct jsonsl_state_st *state, char *at)
+{
+    jsl_STREAM *stream = (jsl_STREAM *)jsn->data;
+    char buf[40] = {0};
+
+    stream->state = JSL_STREAM_FAILED;
+    /* the virtual list takes the first position of the lexer */
+    sprintf(buf, "error at %lu position", (unsigned long)(stream->offset + stream->value_begin + jsn->pos - 1));
+    jsl_raise(err, buf);
+    (void)at;
+    (void)state;
+    return 0;
+}
+
+static void jsl_stream_pop_callback(jsonsl_t jsn, jsonsl_action_t action, struct jsonsl_state_st *state,
+                                    const jsonsl_char_t *at)
+{
+    jsl_STREAM *stream = (jsl_STREAM *)jsn->data;
+    const char *begin, *end;
+
+    if (state->level == 1) {
+        /* only a stray closing bracket can close the virtual list */
+        jsl_stream_error_callback(jsn, JSONSL_ERROR_STRAY_TOKEN, state, (char *)at);
+    }
+    if (!stream->raw) {
+        stream->builder_pop(jsn, action, state, at);
+    }
+    if (state->level != 2) {
+        return;
+    }
+    end = (const char *)at + (state->type == JSONSL_T_SPECIAL ? 0 : 1);
+    if (stream->raw) {
+        begin = (const char *)at - (jsn->pos - state->pos_begin);
+        stream->pending = rb_utf8_str_new(begin, end - begin);
+        if (stream->ctx.freeze) {
+            rb_str_freeze(stream->pending);
+        }
+    } else {
+        stream->pending = stream->values.ptr[--stream->values.len];
+    }
+    stream->value_end = end - RSTRING_PTR(stream->buffer);
+    stream->done = 1;
+    jsonsl_stop(jsn);
+}
+
+static VALUE jsl_stream_init(int argc, VALUE *argv, VALUE self)
+{
+    jsl_STREAM *stream = DATA_PTR(self);
+    VALUE nlevels = Qnil, opts = Qnil, proc = Qnil, batch = Qnil;
+    jsonsl_t jsn;
+
+    rb_scan_args(argc, argv, "01:&", &nlevels, &opts, &proc);
+    if (proc == Qnil) {
+        rb_raise(rb_eArgError, "tried to create StreamParser object without a block");
+    }
+    stream->raw = 0;
+    stream->lines = 0;
+    stream->batch_size = 0;
+    stream->ctx.symbolize_names = 0;
+    stream->ctx.freeze = 0;
+    if (opts != Qnil) {
+        stream->raw = RTEST(rb_hash_aref(opts, jsl_sym_raw));
+        stream->lines = RTEST(rb_hash_aref(opts, jsl_sym_lines));
+        stream->ctx.symbolize_names = RTEST(rb_hash_aref(opts, jsl_sym_symbolize_names));
+        stream->ctx.freeze = RTEST(rb_hash_aref(opts, jsl_sym_freeze));
+        batch = rb_hash_aref(opts, jsl_sym_batch);
+        if (batch != Qnil) {
+            stream->batch_size = NUM2LONG(batch);
+            if (stream->batch_size <= 0) {
+                rb_raise(rb_eArgError, "batch size must be positive");
+            }
+        }
+    }
+    if (nlevels != Qnil) {
+        Check_Type(nlevels, T_FIXNUM);
+    }
+    /* the virtual list takes one level on top of the ones asked for */
+    jsn = jsonsl_new((nlevels == Qnil ? JSONSL_MAX_LEVELS : FIX2INT(nlevels)) + 1);
+    if (jsn == NULL) {
+        rb_raise(rb_eArgError, "invalid nesting level: %+" PRIsVALUE, nlevels);
+    }
+    if (stream->jsn) {
+        jsonsl_destroy(stream->jsn);
+    }
+    stream->jsn = jsn;
+    jsl_lexer_setup(jsn);
+    stream->builder_pop = jsn->action_callback_POP;
+    jsn->action_callback_POP = jsl_stream_pop_callback;
+    jsn->error_callback = jsl_stream_error_callback;
+    if (stream->raw) {
+        /* only the boundaries of the top-level values are interesting */
+        jsn->action_callback_PUSH = NULL;
+        jsn->max_callback_level = 3;
+    }
+    jsn->data = &stream->ctx;
+    stream->ctx.values = &stream->values;
+    stream->proc = proc;
+    stream->buffer = rb_str_buf_new(0);
+    stream->batch = Qnil;
+    stream->pending = Qnil;
+    stream->state = JSL_STREAM_IDLE;
+    stream->newline = 1;
+    stream->fed = stream->value_begin = stream->value_end = stream->offset = 0;
+    jsl_shapes_reset(&stream->ctx.shapes);
+    return self;
+}
+
+static void jsl_stream_emit(jsl_STREAM *stream, VALUE val)
+{
+    VALUE batch;
+
+    if (stream->batch_size == 0) {
+        rb_funcall(stream->proc, jsl_id_call, 1, val);
+        return;
+    }
+    if (stream->batch == Qnil) {
+        stream->batch = rb_ary_new_capa(stream->batch_size);
+    }
+    rb_ary_push(stream->batch, val);
+    if (RARRAY_LEN(stream->batch) >= stream->batch_size) {
+        batch = stream->batch;
+        stream->batch = Qnil;
+        rb_funcall(stream->proc, jsl_id_call, 1, batch);
+    }
+}
+
+static int jsl_stream_is_space(char ch)
+{
+    return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t' || ch == '\x1e';
+}
+
+/* Drops the input before the open value, or all of it between values */
+static void jsl_stream_compact(jsl_STREAM *stream)
+{
+    size_t keep = stream->state == JSL_STREAM_VALUE ? stream->value_begin : stream->fed;
+    long len = RSTRING_LEN(stream->buffer);
+
+    if (keep == 0) {
+        return;
+    }
+    rb_str_modify(stream->buffer);
+    memmove(RSTRING_PTR(stream->buffer), RSTRING_PTR(stream->buffer) + keep, len - keep);
+    rb_str_set_len(stream->buffer, len - keep);
+    stream->offset += keep;
+    stream->fed -= keep;
+    if (stream->state == JSL_STREAM_VALUE) {
+        stream->value_begin = 0;
+    }
+}
+
+static void jsl_stream_fail(jsl_STREAM *stream, jsonsl_error_t err, size_t pos)
+{
+    char buf[40] = {0};
+
+    stream->state = JSL_STREAM_FAILED;
+    sprintf(buf, "error at %lu position", (unsigned long)(stream->offset + pos));
+    jsl_raise(err, buf);
+}
+
+static void jsl_stream_feed(jsl_STREAM *stream, const char *data, long data_len)
+{
+    const char *buf;
+    long len;
+    VALUE val;
+
+    if (stream->state == JSL_STREAM_FAILED) {
+        jsl_raise_msg("stream parser failed, reset it before feeding more data");
+    }
+    jsl_stream_compact(stream);
+    rb_str_cat(stream->buffer, data, data_len);
+    /* cached key shapes point into the buffer */
+    jsl_shapes_reset(&stream->ctx.shapes);
+    for (;;) {
+        buf = RSTRING_PTR(stream->buffer);
+        len = RSTRING_LEN(stream->buffer);
+        if (stream->state == JSL_STREAM_IDLE) {
+            while (stream->fed < (size_t)len && jsl_stream_is_space(buf[stream->fed])) {
+                stream->newline |= buf[stream->fed] == '\n';
+                stream->fed++;
+            }
+            if (stream->fed == (size_t)len) {
+                break;
+            }
+            if (stream->lines && !stream->newline) {
+                jsl_stream_fail(stream, JSONSL_ERROR_GARBAGE_TRAILING, stream->fed);
+            }
+            stream->value_begin = stream->fed;
+            stream->values.len = 0;
+            jsonsl_reset(stream->jsn);
+            jsonsl_feed(stream->jsn, "[", 1);
+        }
+        /*
+         * The lexer, the tree builder (invalid UTF-8, bad escapes) or an
+         * interrupt might raise in the middle of the feed, which leaves the
+         * lexer half-fed. The state is restored only after a clean return.
+         */
+        stream->state = JSL_STREAM_FAILED;
+        stream->done = 0;
+        jsonsl_feed(stream->jsn, buf + stream->fed, len - stream->fed);
+        if (!stream->done) {
+            stream->state = JSL_STREAM_VALUE;
+            stream->fed = len;
+            break;
+        }
+        if (stream->lines) {
+            /* strings cannot hold raw newlines, so this one is between tokens */
+            const char *nl = memchr(buf + stream->value_begin, '\n', stream->value_end - stream->value_begin);
+            if (nl) {
+                jsl_stream_fail(stream, JSONSL_ERROR_WEIRD_WHITESPACE, nl - buf);
+            }
+        }
+        stream->fed = stream->value_end;
+        stream->newline = 0;
+        stream->state = JSL_STREAM_IDLE;
+        val = stream->pending;
+        stream->pending = Qnil;
+        /* the stream is consistent here, even if the block raises */
+        jsl_stream_emit(stream, val);
+    }
+}
+
+static void jsl_stream_finish(jsl_STREAM *stream)
+{
+    VALUE batch;
+
+    if (stream->state == JSL_STREAM_VALUE) {
+        /* terminates a trailing number or literal */
+        jsl_stream_feed(stream, "\n", 1);
+    }
+    if (stream->state == JSL_STREAM_VALUE) {
+        stream->state = JSL_STREAM_FAILED;
+        jsl_raise_msg("unexpected end of data");
+    }
+    if (stream->state == JSL_STREAM_FAILED) {
+        jsl_raise_msg("stream parser failed, reset it before feeding more data");
+    }
+    if (stream->batch != Qnil) {
+        batch = stream->batch;
+        stream->batch = Qnil;
+        rb_funcall(stream->proc, jsl_id_call, 1, batch);
+    }
+}
+
+static VALUE jsl_stream_feed_m(VALUE self, VALUE data)
+{
+    jsl_STREAM *stream = jsl_stream_get(self);
+
+    Check_Type(data, T_STRING);
+    jsl_stream_feed(stream, RSTRING_PTR(data), RSTRING_LEN(data));
+    RB_GC_GUARD(data);
+    return self;
+}
+
+static VALUE jsl_stream_finish_m(VALUE self)
+{
+    jsl_stream_finish(jsl_stream_get(self));
+    return self;
+}
+
+static VALUE jsl_stream_consume(int argc, VALUE *argv, VALUE self)
+{
+    jsl_STREAM *stream = jsl_stream_get(self);
+    VALUE io = Qnil, opts = Qnil, outbuf, chunk;
+    long chunk_size;
+
+    rb_scan_args(argc, argv, "1:", &io, &opts);
+    chunk_size = jsl_chunk_size(opts);
+    outbuf = rb_str_buf_new(chunk_size);
+    while ((chunk = jsl_io_read(io, chunk_size, outbuf)) != Qnil) {
+        jsl_stream_feed(stream, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+    }
+    jsl_stream_finish(stream);
+    RB_GC_GUARD(outbuf);
+    return self;
+}
+
+static VALUE jsl_stream_reset(VALUE self)
+{
+    jsl_STREAM *stream = jsl_stream_get(self);
+
+    rb_str_set_len(stream->buffer, 0);
+    stream->batch = Qnil;
+    stream->pending = Qnil;
+    stream->values.len = 0;
+    stream->state = JSL_STREAM_IDLE;
+    stream->newline = 1;
+    stream->fed = stream->value_begin = stream->value_end = stream->offset = 0;
+    jsonsl_reset(stream->jsn);
+    return self;
+}
+
+static VALUE jsl_stream_inspect(VALUE self)
+{
+    jsl_STREAM *stream = DATA_PTR(self);
+    VALUE str;
+
+    str = rb_str_buf_new2("#<");
+    rb_str_buf_cat2(str, rb_obj_classname(self));
+    rb_str_catf(str, ":%p", (void *)self);
+    if (stream->buffer != Qnil) {
+        rb_str_catf(str, " pos=%lu buflen=%lu", (unsigned long)(stream->offset + stream->fed),
+                    (unsigned long)RSTRING_LEN(stream->buffer));
+    }
+    rb_str_buf_cat_ascii(str, ">");
+
+    return str;
+}
+
+void jsl_stream_parser_init()
+{
+    jsl_sym_raw = ID2SYM(rb_intern("raw"));
+    jsl_sym_batch = ID2SYM(rb_intern("batch"));
+    jsl_sym_lines = ID2SYM(rb_intern("lines"));
+
+    jsl_cStreamParser = rb_define_class_under(jsl_mJSONSL, "StreamParser", rb_cObject);
+    rb_define_alloc_func(jsl_cStreamParser, jsl_stream_alloc);
+    rb_define_method(jsl_cStreamParser, "initialize", jsl_stream_init, -1);
+    rb_define_method(jsl_cStreamParser, "inspect", jsl_stream_inspect, 0);
+    rb_define_method(jsl_cStreamParser, "feed", jsl_stream_feed_m, 1);
+    rb_define_method(jsl_cStreamParser, "finish", jsl_stream_finish_m, 0);
+    rb_define_method(jsl_cStreamParser, "consume", jsl_stream_consume, -1);
+    rb_define_method(jsl_cStreamParser, "reset", jsl_stream_reset, 0);
+}
@@ -20,4 +20,506 @@ class JSONSLTest < Minitest::Test
   def test_that_it_has_a_version_number
     refute_nil ::JSONSL::VERSION
   end
+
+  def test_long_strings
+    (0..70).each do |len|
+      str = 'x' * len
+      assert_equal({'k' => [str, "#{str}\"#{str}"]}, JSONSL.parse("{\"k\":[\"#{str}\",\"#{str}\\\"#{str}\"]}"))
+    end
+  end
+
+  def test_control_characters_in_strings
+    [0x00, 0x0a, 0x14, 0x1f].each do |chr|
+      assert_raises(JSONSL::Error) do
+        JSONSL.parse("[\"#{'x' * 40}#{chr.chr}\"]")
+      end
+    end
+  end
+
+  def test_pretty_printed_input
+    json = "{\n  \"a\": [\n    1,\n    {\n\t\t\"b\" :  \"c d\"\r\n    }\n  ],   \n  \"e\": null\n}" + (' ' * 40)
+    assert_equal({'a' => [1, {'b' => 'c d'}], 'e' => nil}, JSONSL.parse(json))
+  end
+
+  def test_index_mode
+    json = "{\"a\": [1, -2.5e3, \"x\\\"y\", true, false, null, {}, []], \"b\": {\"c\": \"#{'z' * 100}\"}}"
+    assert_equal JSONSL.parse(json), JSONSL.parse(json, :mode => :index)
+    ['[1,]', '{"a" 1}', '[1 2]', '["abc]', '{"a":tru}', '[01]', '[1]]'].each do |invalid|
+      assert_raises(JSONSL::Error) do
+        JSONSL.parse(invalid, :mode => :index)
+      end
+    end
+    assert_raises(ArgumentError) do
+      JSONSL.parse('[]', :mode => :unknown)
+    end
+  end
+
+  def test_index_errors
+    # the byte after a shared substring must not be read as the escaped one
+    # (builds without the index report the end of data, as the lexer does)
+    src = "[\"#{'x' * 100}\\n\"]"
+    [src[0, 103], '["\\', "[\"#{'x' * 61}\\"].each do |json|
+      err = assert_raises(JSONSL::Error) { JSONSL.parse(json, :mode => :index) }
+      assert_match(/at #{json.bytesize} position.*ESCAPE_INVALID|unexpected end of data/, err.message)
+    end
+    ["[\"\\\x01\"]", "[\"a\x1fb\"]", "[1,\x01 2]", "[\x00]", "{\x01:1}", "{\x00:1}", "{a:1}", "{\"a\":\x02}"].each do |json|
+      messages = [:lexer, :index].map do |mode|
+        assert_raises(JSONSL::Error) { JSONSL.parse(json, :mode => mode) }.message[/error at.*"\w+"/]
+      end
+      assert_equal messages[0], messages[1], json.inspect
+    end
+  end
+
+  def test_stats
+    stats = {}
+    assert_equal({ 'a' => [1, 'xyz'] }, JSONSL.parse('{"a": [1, "xyz"]}', :stats => stats))
+    assert_equal 17, stats[:total]
+    assert_equal 2, stats[:allowed_whitespace]
+    assert_equal 4, stats[:stringy_insignificant]
+
+    parser = JSONSL::RowParser.new('/rows/^', :stats => true) {}
+    parser.feed('{"rows":[1,2]}')
+    assert_equal 14, parser.stats[:total]
+    assert_nil JSONSL::RowParser.new('/rows/^') {}.stats
+    assert_raises(ArgumentError) { JSONSL.parse('[1]', :mode => :index, :stats => {}) }
+  end
+
+  def test_row_parser_skips_row_contents
+    doc = '{"rows":[{"a":{"b":["]}\\"",{"c":"{["}]}},[[1],{"d":"\\\\"}],3],"meta":{"x":{"y":[]}}}'
+    [doc.size, 1].each do |chunk|
+      rows = []
+      parser = JSONSL::RowParser.new('/rows/^') { |*args| rows << args }
+      doc.scan(/.{1,#{chunk}}/m).each { |part| parser.feed(part) }
+      assert_equal [['{"a":{"b":["]}\\"",{"c":"{["}]}}', 0],
+                    ['[[1],{"d":"\\\\"}]', 1],
+                    ['3', 2],
+                    ['{"rows":[],"meta":{"x":{"y":[]}}}']], rows
+    end
+  end
+
+  def test_valid
+    ['{}', '[1, 2.5, "x"]', "{\"a\": [true, {\"b\": null}]}\n"].each do |json|
+      assert JSONSL.valid?(json)
+    end
+    ['', '[1,]', '{"a" 1}', '[', '[1]]', '["abc]', "[\"\x01\"]"].each do |json|
+      refute JSONSL.valid?(json)
+    end
+    ['["\\uZZZZ"]', '["\\ud83d"]', '{"\\udc00": 1}'].each do |json|
+      assert_raises(JSONSL::Error) { JSONSL.parse(json) }
+      refute JSONSL.valid?(json), json
+    end
+    assert JSONSL.valid?('["\\ud83d\\ude00", "\\n"]')
+    refute JSONSL.valid?('[[[1]]]', 3)
+    assert_equal [true, false, false, true], JSONSL.validate_all(['[]', '[', nil, '{"a":1}'])
+  end
+
+  def test_deep_nesting
+    [15, 16, 17, 100, 510].each do |depth|
+      assert JSONSL.valid?("#{'[' * depth}1#{']' * depth}"), "depth #{depth}"
+    end
+    refute JSONSL.valid?("#{'[' * 512}#{']' * 512}")
+    assert JSONSL.valid?("#{'{"a":' * 40}1#{'}' * 40}", 42)
+    refute JSONSL.valid?("#{'{"a":' * 40}1#{'}' * 40}", 41)
+    assert_equal({'a' => 20.times.inject(1) { |val| [val] }}, JSONSL.parse("{\"a\":#{'[' * 20}1#{']' * 20}}"))
+  end
+
+  def test_parser_reuse
+    parser = JSONSL::Parser.new
+    assert_equal({'a' => [1, 'b']}, parser.parse('{"a": [1, "b"]}'))
+    assert_raises(JSONSL::Error) do
+      parser.parse('{"a": [1,')
+    end
+    assert_equal [true, nil], parser.parse('[true, null]')
+    assert_equal [1], parser.reset.parse('[1]', :mode => :index)
+    stats = {}
+    parser.parse('[1, 2]', :stats => stats)
+    assert_equal 6, stats[:total]
+    assert_raises(JSONSL::Error) do
+      JSONSL::Parser.new(3).parse('[[[1]]]')
+    end
+  end
+
+  def test_string_escapes
+    json = '{"a\\tb": ["x\\ny", "\\u00e9\\ud83d\\ude00", "q\\"\\\\\\/", "plain"]}'
+    expected = {"a\tb" => ["x\ny", "é\u{1f600}", "q\"\\/", 'plain']}
+    assert_equal expected, JSONSL.parse(json)
+    assert_equal expected, JSONSL.parse(json, :mode => :index)
+    ['["\\uZZZZ"]', '["\\ud83d"]'].each do |invalid|
+      assert_raises(JSONSL::Error) do
+        JSONSL.parse(invalid)
+      end
+    end
+  end
+
+  def test_hash_keys
+    json = '[{"id": 1, "a\\"b": 2}, {"id": 3, "a\\"b": 4}]'
+    [:lexer, :index].each do |mode|
+      rows = JSONSL.parse(json, :mode => mode)
+      assert rows[0].keys.all?(&:frozen?)
+      assert_same rows[0].keys[0], rows[1].keys[0]
+      assert_equal [{:id => 1, :'a"b' => 2}, {:id => 3, :'a"b' => 4}],
+                   JSONSL.parse(json, :mode => mode, :symbolize_names => true)
+    end
+  end
+
+  def test_utf8_strings
+    json = "{\"k\\u00e9\": [\"#{'x' * 40}\", \"#{'y' * 40}\u00e9\", \"\\u0041\"]}"
+    [:lexer, :index].each do |mode|
+      res = JSONSL.parse(json, :mode => mode)
+      assert_equal({"k\u00e9" => ['x' * 40, "#{'y' * 40}\u00e9", 'A']}, res)
+      (res.keys + res.values.first).each do |str|
+        assert_equal Encoding::UTF_8, str.encoding
+        assert str.valid_encoding?
+      end
+    end
+    rows = []
+    JSONSL::RowParser.new('/rows/^') { |row, _| rows << row }.feed("{\"rows\":[\"\u00e9\"]}")
+    assert_equal [Encoding::UTF_8] * 2, rows.map(&:encoding)
+  end
+
+  def test_invalid_utf8
+    ["[\"\xff\"]", "{\"\xc3\": 1}", "[\"a\\n\xed\xa0\x80\"]", "[\"\xc0\xaf\"]", "[\"\xf4\x90\x80\x80\"]"].each do |json|
+      json = json.b
+      [:lexer, :index].each do |mode|
+        err = assert_raises(JSONSL::Error) { JSONSL.parse(json, :mode => mode) }
+        assert_match(/INVALID_CODEPOINT/, err.message)
+      end
+      assert_raises(JSONSL::Error) { JSONSL.parse(json, :mode => :lexer, :freeze => true) }
+      refute JSONSL.valid?(json)
+    end
+    assert_raises(JSONSL::Error) do
+      JSONSL::RowParser.new('/rows/^') { |_row, _idx| }.feed("{\"rows\":[\"\xff\"]}".b)
+    end
+    assert_equal ["\u00e9"], JSONSL.parse("[\"\u00e9\"]".b, :mode => :index)
+  end
+
+  def test_integers
+    ints = [0, 1, -1, 9, -9, 1234567890123, -1234567890123,
+            2**63 - 1, -2**63, 2**63, -2**63 - 1, 2**64 - 1, 2**64,
+            10**19 - 1, -(10**19 - 1), 10**19, 10**40, -10**40]
+    [:lexer, :index].each do |mode|
+      assert_equal ints, JSONSL.parse(ints.to_s, :mode => mode)
+      assert_equal [0, 0, 7], JSONSL.parse('[-0,0,7]', :mode => mode)
+    end
+  end
+
+  def test_integer_digit_runs
+    digits = '9876543210' * 3
+    texts = (1..30).map { |n| digits[0, n] } +
+            %w[9223372036854775807 -9223372036854775808 9223372036854775808 -9223372036854775809
+               18446744073709551615 18446744073709551616 9999999999999999999 10000000000000000000
+               -9999999999999999999 99999999999999999999 12345678.5 123456789012345678.25e-3]
+    values = texts.map { |text| text.include?('.') ? Float(text) : Integer(text) }
+    # shift the runs across the eight byte loads
+    (0..7).each do |pad|
+      json = "[#{texts.map { |text| (' ' * pad) + text }.join(',')}]"
+      [:lexer, :index].each do |mode|
+        assert_equal values, JSONSL.parse(json, :mode => mode)
+      end
+      # and across the chunks fed to the lexer
+      [1, 3, 7, 8, 9, 13].each do |chunk_size|
+        assert_equal values, JSONSL.parse_io(StringIO.new(json), :chunk_size => chunk_size)
+        res = []
+        parser = JSONSL::StreamParser.new { |val| res << val }
+        "#{texts.join(' ' * (pad + 1))} ".scan(/.{1,#{chunk_size}}/m).each { |chunk| parser.feed(chunk) }
+        parser.finish
+        assert_equal values, res
+      end
+    end
+  end
+
+  def test_floats
+    floats = %w[0.0 -0.0 0.1 -1.5 3.25e2 1E22 1e23 -2.5e-3 123.456e+7 0.30000000000000004
+                9007199254740993.0 1.7976931348623157e308 4.9e-324 1e400 -1e400
+                3.14159265358979323846264338327950288419716939937510]
+    [:lexer, :index].each do |mode|
+      res = JSONSL.parse("[#{floats.join(',')}]", :mode => mode)
+      floats.zip(res).each { |str, val| assert_equal Float(str).to_s, val.to_s }
+      assert_raises(JSONSL::Error) { JSONSL.parse('[-01]', :mode => mode) }
+    end
+  end
+
+  def test_gc_stress
+    json = '{"a":[1,"two",{"b":[3.5,null,true],"a":"dup"}],"c":{},"d":[],"a":[' + (1..40).to_a.join(',') + ']}'
+    expected = {'a' => (1..40).to_a, 'c' => {}, 'd' => []}
+    parser = JSONSL::Parser.new
+    GC.stress = true
+    assert_equal expected, JSONSL.parse(json)
+    assert_equal expected, parser.parse(json)
+  ensure
+    GC.stress = false
+  end
+
+  def test_sibling_sizes
+    rows = [[1, 2, 3], [], [4], (1..5000).to_a, [5, 6], {'a' => 1, 'b' => [{}, {'c' => 2}]}, {}, {'d' => [[7]]}]
+    json = rows.to_s.gsub('=>', ':')
+    [:lexer, :index].each do |mode|
+      assert_equal rows, JSONSL.parse(json, :mode => mode)
+    end
+  end
+
+  def test_key_shapes
+    json = '[{"a":1,"b":{"c":2}},{"a":3,"b":{"c":4}},{"b":5,"a":6},{"ab":7},{"a":8,"b\\n":9,"x":{"c":0}},{"a":1,"a":2}]'
+    expected = [{'a' => 1, 'b' => {'c' => 2}}, {'a' => 3, 'b' => {'c' => 4}}, {'b' => 5, 'a' => 6}, {'ab' => 7},
+                {'a' => 8, "b\n" => 9, 'x' => {'c' => 0}}, {'a' => 2}]
+    [:lexer, :index].each do |mode|
+      rows = JSONSL.parse(json, :mode => mode)
+      assert_equal expected, rows
+      assert_same rows[0].keys[1], rows[1].keys[1]
+      assert_same rows[0]['b'].keys[0], rows[4]['x'].keys[0]
+      assert_equal expected.map { |row| row.keys.map(&:to_sym) },
+                   JSONSL.parse(json, :mode => mode, :symbolize_names => true).map(&:keys)
+    end
+  end
+
+  def test_parse_io
+    json = '{"rows":[{"id":1,"k\\"ey":"val\\u00e9ue"},{"id":-12.5e-1,"k\\"ey":[true,null,123456789012345678901]}]}'
+    expected = JSONSL.parse(json)
+    [1, 2, 3, 7, 1024].each do |chunk_size|
+      assert_equal expected, JSONSL.parse_io(StringIO.new(json), :chunk_size => chunk_size)
+    end
+    assert_raises(JSONSL::Error) { JSONSL.parse_io(StringIO.new(json[0..-2])) }
+    assert_raises(ArgumentError) { JSONSL.parse_io(StringIO.new(json), :chunk_size => 0) }
+
+    rows = []
+    JSONSL::RowParser.new('/rows/^') { |row, _| rows << row }.consume(StringIO.new(json), :chunk_size => 5)
+    assert_equal expected['rows'], rows[0..1].map { |row| JSONSL.parse(row) }
+  end
+
+  def test_parse_file
+    json = '{"rows":[{"id":1,"name":"one"},{"id":2.5,"name":"tw\\u00f6"}],"total":2}'
+    file = Tempfile.new('jsonsl')
+    file.write(json)
+    file.close
+    [:lexer, :index].each do |mode|
+      assert_equal JSONSL.parse(json), JSONSL.parse_file(file.path, :mode => mode)
+    end
+    assert_raises(Errno::ENOENT) { JSONSL.parse_file("#{file.path}.missing") }
+
+    rows = []
+    JSONSL::RowParser.new('/rows/^') { |row, _| rows << row }.consume_file(file.path)
+    assert_equal ['{"id":1,"name":"one"}', '{"id":2.5,"name":"tw\\u00f6"}', '{"rows":[],"total":2}'], rows
+
+    # a truncated file keeps only the header and the open row for the next feeds
+    big = (0...1000).map { |i| %({"id":#{i}}) }
+    cut = %({"meta":1,"rows":[#{big.join(',')},{"id":)
+    File.binwrite(file.path, cut)
+    rows = []
+    parser = JSONSL::RowParser.new('/rows/^') { |row, _| rows << row }
+    parser.consume_file(file.path)
+    assert_equal big, rows
+    assert_equal '{"meta":1,"rows":[{"id":'.size, parser.buffer_size
+    parser.feed('1000}],"total":0}')
+    assert_equal big + ['{"id":1000}', '{"meta":1,"rows":[],"total":0}'], rows
+    assert_equal 0, parser.buffer_size
+  ensure
+    file.unlink if file
+  end
+
+  def test_stream_parser
+    values = [{'a' => [1, 'x']}, [], 42, -1.5, 'str', true, nil, {'a' => []}]
+    texts = ['{"a":[1,"x"]}', '[]', '42', '-1.5', '"str"', 'true', 'null', '{"a":[]}']
+    ["#{texts.join("\n")}\n", texts.map { |text| "\x1e#{text}\n" }.join, texts.join(' ')].each do |json|
+      [1, 3, 1024].each do |chunk_size|
+        res = []
+        parser = JSONSL::StreamParser.new { |val| res << val }
+        json.scan(/.{1,#{chunk_size}}/m).each { |chunk| parser.feed(chunk) }
+        parser.finish
+        assert_equal values, res
+      end
+    end
+
+    res = []
+    JSONSL::StreamParser.new(:raw => true, :batch => 3) { |batch| res << batch }.consume(StringIO.new(texts.join("\n")))
+    assert_equal texts.each_slice(3).to_a, res
+
+    parser = JSONSL::StreamParser.new { |val| res << val }
+    assert_raises(JSONSL::Error) { parser.feed('{"a":1} {"a" 2}') }
+    assert_raises(JSONSL::Error) { parser.feed('[]') }
+    assert_raises(JSONSL::Error) { parser.reset.feed('[1').finish }
+
+    res = []
+    parser = JSONSL::StreamParser.new { |val| res << val }
+    ["{\"a\":\"\xff\"}\n".b, '["\\uZZZZ"]'].each do |invalid|
+      assert_raises(JSONSL::Error) { parser.feed(invalid) }
+      err = assert_raises(JSONSL::Error) { parser.feed(%({"b":1}\n)) }
+      assert_match(/reset it/, err.message)
+      parser.reset
+    end
+    parser.feed(%({"b":1}\n))
+    assert_equal [{'b' => 1}], res
+
+    res = []
+    parser = JSONSL::StreamParser.new(:lines => true) { |val| res << val }
+    parser.feed("1\n[2")
+    parser.feed("]\n")
+    assert_equal [1, [2]], res
+    assert_raises(JSONSL::Error) { parser.feed('3 4') }
+
+    [3, 5].each do |nlevels|
+      (1..5).each do |depth|
+        json = "#{'[' * depth}1#{']' * depth}"
+        expected = begin
+          JSONSL::Parser.new(nlevels).parse(json)
+        rescue JSONSL::Error => ex
+          ex.class
+        end
+        res = []
+        begin
+          JSONSL::StreamParser.new(nlevels) { |val| res << val }.feed(json).finish
+        rescue JSONSL::Error => ex
+          res << ex.class
+        end
+        assert_equal [expected], res, "depth #{depth} with #{nlevels} levels"
+      end
+    end
+  end
+
+  def test_parse_lines
+    rows = (0...20_000).map { |i| {'id' => i, 'name' => "user#{i}", 'tags' => ['a', i * 0.5]} }
+    json = rows.map { |row| %({"id":#{row['id']},"name":"#{row['name']}","tags":["a",#{row['tags'][1]}]}) }.join("\n")
+    # the index, and the StreamParser used without it, must agree
+    [:index, :lexer].each do |mode|
+      [1, 4].each do |threads|
+        assert_equal rows, JSONSL.parse_lines(json, :threads => threads, :mode => mode)
+      end
+      assert_equal [1, 'a', [], {:a => nil}],
+                   JSONSL.parse_lines("1\n\"a\"\n\n[]\r\n{\"a\":null}\n", :symbolize_names => true, :mode => mode)
+      assert_equal [], JSONSL.parse_lines('', :mode => mode)
+      assert_raises(JSONSL::Error) { JSONSL.parse_lines("#{json}\n[1", :threads => 4, :mode => mode) }
+      assert_raises(ArgumentError) { JSONSL.parse_lines('1', :threads => 0, :mode => mode) }
+      {"1 2\n3\n" => /at 2 position.*GARBAGE_TRAILING/, "1\n[1,\n2]\n" => /at 5 position.*WEIRD_WHITESPACE/,
+       "[] {}\n" => /at 3 position.*GARBAGE_TRAILING/}.each do |invalid, message|
+        err = assert_raises(JSONSL::Error) { JSONSL.parse_lines(invalid, :mode => mode) }
+        assert_match message, err.message
+      end
+    end
+  end
+
+  def test_release_gvl
+    json = "[#{(0...1000).map { |i| %({"id":#{i},"name":"user#{i}"}) }.join(',')}]"
+    expected = JSONSL.parse(json, :mode => :lexer)
+    [true, false, 1024].each do |release_gvl|
+      assert_equal expected, JSONSL.parse(json, :release_gvl => release_gvl)
+      assert JSONSL.valid?(json, :release_gvl => release_gvl)
+      refute JSONSL.valid?(json[0..-2], :release_gvl => release_gvl)
+    end
+    assert_equal [true, false], JSONSL.validate_all([json, json[1..-1]], :release_gvl => true)
+  end
+
+  def test_default_mode_at_gvl_threshold
+    outcome = lambda do |json, opts|
+      begin
+        JSONSL.parse(json, **opts)
+      rescue JSONSL::Error => ex
+        ex.class
+      end
+    end
+    ['1.e5', '0e.5', '1 "a"', '"x"'].each do |tail|
+      json = "[#{'1,' * (1 << 19)}#{tail}]"
+      assert_operator json.bytesize, :>=, 1 << 20
+      expected = outcome.call(json, :mode => :lexer)
+      [{}, {:release_gvl => true}, {:release_gvl => false}].each do |opts|
+        assert_equal expected, outcome.call(json, opts), "#{tail} #{opts}"
+      end
+    end
+  end
+
+  def test_input_changed_during_parse
+    docs = %w[x y].map { |val| "[#{(["\"#{val}\""] * (1 << 18)).join(',')}]" }
+    expected = docs.map { |json| JSONSL.parse(json, :mode => :lexer) }
+    parser = JSONSL::Parser.new
+    [:lexer, :index].each do |mode|
+      input = docs[0].dup
+      done = false
+      writer = Thread.new do
+        # same length, so the bytes are overwritten in place
+        until done
+          input[0, input.bytesize] = docs[1]
+          input[0, input.bytesize] = docs[0]
+          Thread.pass
+        end
+      end
+      begin
+        5.times do
+          assert_includes expected, JSONSL.parse(input, :mode => mode, :release_gvl => true)
+          assert_includes expected, parser.parse(input, :mode => mode, :release_gvl => true)
+        end
+      ensure
+        done = true
+        writer.join
+      end
+    end
+  end
+
+  def test_ractors
+    skip 'Ractor is not available' unless defined?(Ractor)
+    verbose, Warning[:experimental] = Warning[:experimental], false
+    ractors = Array.new(2) do |ii|
+      Ractor.new(ii) do |id|
+        rows = []
+        JSONSL::RowParser.new('/rows/^') { |row, _| rows << row }.feed(%({"rows":[{"id":#{id}}]}))
+        [JSONSL.parse(%([#{id}])), JSONSL.parse(%({"id":#{id}}), :mode => :index), rows]
+      end
+    end
+    ractors.each_with_index do |ractor, ii|
+      res = ractor.respond_to?(:value) ? ractor.value : ractor.take
+      assert_equal [[ii], {'id' => ii}, [%({"id":#{ii}}), %({"rows":[]})]], res
+    end
+  ensure
+    Warning[:experimental] = verbose if defined?(Ractor)
+  end
+
+  def test_freeze
+    json = '{"a":[1,"x",{"b":"x\\n"}],"c":"x","d":[]}'
+    [:lexer, :index].each do |mode|
+      res = JSONSL.parse(json, :mode => mode, :freeze => true)
+      assert_equal JSONSL.parse(json), res
+      assert res.frozen?
+      assert res['a'].frozen?
+      assert res['a'][2]['b'].frozen?
+      assert res['d'].frozen?
+      assert_same res['a'][1], res['c']
+      assert Ractor.shareable?(res) if defined?(Ractor)
+    end
+    refute JSONSL.parse(json)['c'].frozen?
+    assert JSONSL.parse_lines(%(["x"]\n"y"\n), :freeze => true).all?(&:frozen?)
+    res = []
+    JSONSL::StreamParser.new(:freeze => true) { |val| res << val }.feed('{"a":"b"} [1]').finish
+    assert_equal [{'a' => 'b'}, [1]], res
+    assert res.all?(&:frozen?)
+    assert res[0]['a'].frozen?
+  end
+
+  def test_row_parser_compaction
+    rows = (0...2000).map { |i| %({"id":#{i},"name":"#{'x' * (i % 50)}"}) } + ['1.5', '"str"']
+    json = %({"meta":{"a":[1]},"rows":[#{rows.join(', ')}],"total":#{rows.size}})
+    res = []
+    buflen = 0
+    parser = JSONSL::RowParser.new('/rows/^') { |row, _| res << row }
+    json.scan(/.{1,37}/m).each do |chunk|
+      parser.feed(chunk)
+      buflen = [buflen, parser.buffer_size].max
+    end
+    assert_equal rows + [%({"meta":{"a":[1]},"rows":[],"total":#{rows.size}})], res
+    assert_operator buflen, :<, 512
+    assert_equal 0, parser.buffer_size
+  end
+
+  def test_index_depth
+    deep = ('[' * 100_000) + (']' * 100_000)
+    # either rejected by the depth cap, or parsed by the lexer when the index is not available
+    parse_deep = lambda do
+      begin
+        JSONSL.parse(deep, 1_000_000, :mode => :index)
+      rescue JSONSL::Error => ex
+        ex
+      end
+    end
+    [parse_deep.call, Fiber.new { parse_deep.call }.resume].each do |res|
+      assert_includes [JSONSL::Error, Array], res.class
+    end
+    nested = ('[' * 1000) + (']' * 1000)
+    assert_equal JSONSL.parse(nested, 1_000_000), Fiber.new { JSONSL.parse(nested, 1_000_000, :mode => :index) }.resume
+  end
 end
@@ -16,5 +16,7 @@
 
 $LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
 require 'jsonsl'
+require 'stringio'
+require 'tempfile'
 
 require 'minitest/autorun'